@@ -0,0 +1,530 @@
+#include "base64.h"
+#include <string.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define BASE64_X86
+#include <immintrin.h>
+#endif
+
+#if defined(__aarch64__) && defined(__ARM_NEON)
+#define BASE64_NEON
+#include <arm_neon.h>
+#endif
+
+static const uint8_t
+base64chars[] =
+  "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+static unsigned int
+encode_scalar(uint8_t *out, const uint8_t *data, unsigned int len)
+{
+  uint32_t bits;
+  uint8_t *start = out;
+  while(len >= 3) {
+    bits = (data[0] << 16) | (data[1] << 8) | data[2];
+    *out++ = base64chars[bits >> 18];
+    *out++ = base64chars[(bits >> 12) & 0x3f];
+    *out++ = base64chars[(bits >> 6) & 0x3f];
+    *out++ = base64chars[bits & 0x3f];
+    data += 3;
+    len -= 3;
+  }
+  if (len == 2)  {
+    bits = (data[0] << 8) | data[1];
+    *out++ = base64chars[bits >> 10];
+    *out++ = base64chars[(bits >> 4) & 0x3f];
+    *out++ = base64chars[(bits << 2) & 0x3f];
+    *out++ = '=';
+  } else if (len == 1) {
+    *out++ = base64chars[data[0] >> 2];
+    *out++ = base64chars[(data[0] << 4) & 0x3f];
+    *out++ = '=';
+    *out++ = '=';
+  }
+  return out - start;
+}
+
+/* Decoding table values that aren't part of the alphabet */
+#define DEC_INVALID 0x80
+#define DEC_SPACE 0x81
+#define DEC_PAD 0x82
+
+static uint8_t decode_table[256];
+
+static void
+init_decode_table(void)
+{
+  unsigned int i;
+  memset(decode_table, DEC_INVALID, sizeof(decode_table));
+  for (i = 0; i < 64; i++) {
+    decode_table[base64chars[i]] = i;
+  }
+  decode_table[' '] = DEC_SPACE;
+  decode_table['\t'] = DEC_SPACE;
+  decode_table['\r'] = DEC_SPACE;
+  decode_table['\n'] = DEC_SPACE;
+  decode_table['='] = DEC_PAD;
+}
+
+/* Decode one character at a time. Handles whitespace, padding and
+   groups split between calls. */
+static int
+decode_scalar(struct Base64Decoder *dec, uint8_t *out,
+	      const uint8_t *in, unsigned int len)
+{
+  uint8_t *start = out;
+  while(len-- > 0) {
+    uint8_t v = decode_table[*in++];
+    if (v < 64) {
+      if (dec->padding > 0) return -1;
+      dec->group[dec->n_group++] = v;
+      if (dec->n_group == 4) {
+	*out++ = (dec->group[0] << 2) | (dec->group[1] >> 4);
+	*out++ = (dec->group[1] << 4) | (dec->group[2] >> 2);
+	*out++ = (dec->group[2] << 6) | dec->group[3];
+	dec->n_group = 0;
+      }
+    } else if (v == DEC_PAD) {
+      if (dec->n_group < 2) return -1;
+      dec->padding++;
+      if (dec->n_group + dec->padding == 4) {
+	*out++ = (dec->group[0] << 2) | (dec->group[1] >> 4);
+	if (dec->n_group == 3) {
+	  *out++ = (dec->group[1] << 4) | (dec->group[2] >> 2);
+	}
+	dec->n_group = 0;
+      }
+    } else if (v != DEC_SPACE) {
+      return -1;
+    }
+  }
+  return out - start;
+}
+
+/* Decoding of whole blocks without whitespace or padding. Returns the
+   number of characters consumed, which decode to 3/4 as many bytes. */
+static unsigned int
+decode_blocks_none(uint8_t *out, const uint8_t *in, unsigned int len)
+{
+  return 0;
+}
+
+static int
+always_supported(void)
+{
+  return 1;
+}
+
+#ifdef BASE64_X86
+
+/* The vector encoders work on groups of 12 input bytes per 128 bit
+   lane. The bytes are shuffled so that each 32 bit word holds one
+   group of three, the four 6 bit indices are moved into separate
+   bytes with multiplications, and the indices are translated to ASCII
+   by adding an offset looked up by range. */
+
+__attribute__((target("ssse3")))
+static inline __m128i
+enc_reshuffle_ssse3(__m128i in)
+{
+  __m128i t0, t1, t2, t3;
+  in = _mm_shuffle_epi8(in, _mm_set_epi8(10, 11, 9, 10, 7, 8, 6, 7,
+					 4, 5, 3, 4, 1, 2, 0, 1));
+  t0 = _mm_and_si128(in, _mm_set1_epi32(0x0fc0fc00));
+  t1 = _mm_mulhi_epu16(t0, _mm_set1_epi32(0x04000040));
+  t2 = _mm_and_si128(in, _mm_set1_epi32(0x003f03f0));
+  t3 = _mm_mullo_epi16(t2, _mm_set1_epi32(0x01000010));
+  return _mm_or_si128(t1, t3);
+}
+
+__attribute__((target("ssse3")))
+static inline __m128i
+enc_translate_ssse3(__m128i in)
+{
+  const __m128i lut = _mm_setr_epi8('a' - 26, '0' - 52, '0' - 52, '0' - 52,
+				    '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+				    '0' - 52, '0' - 52, '0' - 52, '+' - 62,
+				    '/' - 63, 'A', 0, 0);
+  /* 0..51 -> 0, 52..61 -> 1..10, 62 -> 11, 63 -> 12 */
+  __m128i offset = _mm_subs_epu8(in, _mm_set1_epi8(51));
+  /* 0..25 -> 13 */
+  __m128i less = _mm_cmpgt_epi8(_mm_set1_epi8(26), in);
+  offset = _mm_or_si128(offset, _mm_and_si128(less, _mm_set1_epi8(13)));
+  return _mm_add_epi8(in, _mm_shuffle_epi8(lut, offset));
+}
+
+__attribute__((target("ssse3")))
+static unsigned int
+encode_ssse3(uint8_t *out, const uint8_t *in, unsigned int len)
+{
+  uint8_t *start = out;
+  /* Each load reads 16 bytes but only uses 12 */
+  while(len >= 16) {
+    __m128i v = _mm_loadu_si128((const __m128i*)in);
+    v = enc_translate_ssse3(enc_reshuffle_ssse3(v));
+    _mm_storeu_si128((__m128i*)out, v);
+    in += 12;
+    len -= 12;
+    out += 16;
+  }
+  return (out - start) + encode_scalar(out, in, len);
+}
+
+__attribute__((target("avx2")))
+static inline __m256i
+enc_reshuffle_avx2(__m256i in)
+{
+  __m256i t0, t1, t2, t3;
+  in = _mm256_shuffle_epi8(in, _mm256_set_epi8(10, 11, 9, 10, 7, 8, 6, 7,
+					       4, 5, 3, 4, 1, 2, 0, 1,
+					       10, 11, 9, 10, 7, 8, 6, 7,
+					       4, 5, 3, 4, 1, 2, 0, 1));
+  t0 = _mm256_and_si256(in, _mm256_set1_epi32(0x0fc0fc00));
+  t1 = _mm256_mulhi_epu16(t0, _mm256_set1_epi32(0x04000040));
+  t2 = _mm256_and_si256(in, _mm256_set1_epi32(0x003f03f0));
+  t3 = _mm256_mullo_epi16(t2, _mm256_set1_epi32(0x01000010));
+  return _mm256_or_si256(t1, t3);
+}
+
+__attribute__((target("avx2")))
+static inline __m256i
+enc_translate_avx2(__m256i in)
+{
+  const __m256i lut = _mm256_setr_epi8('a' - 26, '0' - 52, '0' - 52, '0' - 52,
+				       '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+				       '0' - 52, '0' - 52, '0' - 52, '+' - 62,
+				       '/' - 63, 'A', 0, 0,
+				       'a' - 26, '0' - 52, '0' - 52, '0' - 52,
+				       '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+				       '0' - 52, '0' - 52, '0' - 52, '+' - 62,
+				       '/' - 63, 'A', 0, 0);
+  __m256i offset = _mm256_subs_epu8(in, _mm256_set1_epi8(51));
+  __m256i less = _mm256_cmpgt_epi8(_mm256_set1_epi8(26), in);
+  offset = _mm256_or_si256(offset, _mm256_and_si256(less, _mm256_set1_epi8(13)));
+  return _mm256_add_epi8(in, _mm256_shuffle_epi8(lut, offset));
+}
+
+__attribute__((target("avx2")))
+static unsigned int
+encode_avx2(uint8_t *out, const uint8_t *in, unsigned int len)
+{
+  uint8_t *start = out;
+  /* Each iteration reads 28 bytes but only uses 24 */
+  while(len >= 28) {
+    __m256i v = _mm256_inserti128_si256(
+      _mm256_castsi128_si256(_mm_loadu_si128((const __m128i*)in)),
+      _mm_loadu_si128((const __m128i*)(in + 12)), 1);
+    v = enc_translate_avx2(enc_reshuffle_avx2(v));
+    _mm256_storeu_si256((__m256i*)out, v);
+    in += 24;
+    len -= 24;
+    out += 32;
+  }
+  /* Finish with 128 bit operations, without leaving AVX code */
+  while(len >= 16) {
+    __m128i v = _mm_loadu_si128((const __m128i*)in);
+    v = enc_translate_ssse3(enc_reshuffle_ssse3(v));
+    _mm_storeu_si128((__m128i*)out, v);
+    in += 12;
+    len -= 12;
+    out += 16;
+  }
+  return (out - start) + encode_scalar(out, in, len);
+}
+
+/* The vector decoders classify each character by its high and low
+   nibble. Any character outside the alphabet makes the block fall back
+   to the scalar decoder. Valid characters are translated to their
+   values by adding an offset selected by the high nibble, and the 6 bit
+   values are packed with multiply-add instructions. */
+
+__attribute__((target("ssse3")))
+static inline int
+dec_translate_ssse3(__m128i *str)
+{
+  const __m128i lut_lo = _mm_setr_epi8(0x15, 0x11, 0x11, 0x11, 0x11, 0x11,
+				       0x11, 0x11, 0x11, 0x11, 0x13, 0x1A,
+				       0x1B, 0x1B, 0x1B, 0x1A);
+  const __m128i lut_hi = _mm_setr_epi8(0x10, 0x10, 0x01, 0x02, 0x04, 0x08,
+				       0x04, 0x08, 0x10, 0x10, 0x10, 0x10,
+				       0x10, 0x10, 0x10, 0x10);
+  const __m128i lut_roll = _mm_setr_epi8(0, 16, 19, 4, -65, -65, -71, -71,
+					 0, 0, 0, 0, 0, 0, 0, 0);
+  const __m128i mask_2f = _mm_set1_epi8(0x2f);
+  __m128i hi_nibbles = _mm_and_si128(_mm_srli_epi32(*str, 4), mask_2f);
+  __m128i lo_nibbles = _mm_and_si128(*str, mask_2f);
+  __m128i hi = _mm_shuffle_epi8(lut_hi, hi_nibbles);
+  __m128i lo = _mm_shuffle_epi8(lut_lo, lo_nibbles);
+  __m128i eq_2f;
+  if (_mm_movemask_epi8(_mm_cmpgt_epi8(_mm_and_si128(lo, hi),
+				       _mm_setzero_si128()))) {
+    return 0;
+  }
+  eq_2f = _mm_cmpeq_epi8(*str, mask_2f);
+  *str = _mm_add_epi8(*str, _mm_shuffle_epi8(lut_roll,
+					     _mm_add_epi8(eq_2f, hi_nibbles)));
+  return 1;
+}
+
+__attribute__((target("ssse3")))
+static inline __m128i
+dec_reshuffle_ssse3(__m128i in)
+{
+  __m128i merged = _mm_maddubs_epi16(in, _mm_set1_epi32(0x01400140));
+  __m128i out = _mm_madd_epi16(merged, _mm_set1_epi32(0x00011000));
+  return _mm_shuffle_epi8(out, _mm_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8,
+					     14, 13, 12, -1, -1, -1, -1));
+}
+
+__attribute__((target("ssse3")))
+static unsigned int
+decode_blocks_ssse3(uint8_t *out, const uint8_t *in, unsigned int len)
+{
+  const uint8_t *start = in;
+  /* Each store writes 16 bytes but only 12 are decoded. Keep enough
+     input left that the extra bytes stay within the output buffer. */
+  while(len >= 24) {
+    __m128i str = _mm_loadu_si128((const __m128i*)in);
+    if (!dec_translate_ssse3(&str)) break;
+    _mm_storeu_si128((__m128i*)out, dec_reshuffle_ssse3(str));
+    in += 16;
+    len -= 16;
+    out += 12;
+  }
+  return in - start;
+}
+
+__attribute__((target("avx2")))
+static unsigned int
+decode_blocks_avx2(uint8_t *out, const uint8_t *in, unsigned int len)
+{
+  const uint8_t *start = in;
+  const __m256i lut_lo = _mm256_setr_epi8(0x15, 0x11, 0x11, 0x11, 0x11, 0x11,
+					  0x11, 0x11, 0x11, 0x11, 0x13, 0x1A,
+					  0x1B, 0x1B, 0x1B, 0x1A,
+					  0x15, 0x11, 0x11, 0x11, 0x11, 0x11,
+					  0x11, 0x11, 0x11, 0x11, 0x13, 0x1A,
+					  0x1B, 0x1B, 0x1B, 0x1A);
+  const __m256i lut_hi = _mm256_setr_epi8(0x10, 0x10, 0x01, 0x02, 0x04, 0x08,
+					  0x04, 0x08, 0x10, 0x10, 0x10, 0x10,
+					  0x10, 0x10, 0x10, 0x10,
+					  0x10, 0x10, 0x01, 0x02, 0x04, 0x08,
+					  0x04, 0x08, 0x10, 0x10, 0x10, 0x10,
+					  0x10, 0x10, 0x10, 0x10);
+  const __m256i lut_roll = _mm256_setr_epi8(0, 16, 19, 4, -65, -65, -71, -71,
+					    0, 0, 0, 0, 0, 0, 0, 0,
+					    0, 16, 19, 4, -65, -65, -71, -71,
+					    0, 0, 0, 0, 0, 0, 0, 0);
+  const __m256i mask_2f = _mm256_set1_epi8(0x2f);
+  /* Each store writes 32 bytes but only 24 are decoded */
+  while(len >= 44) {
+    __m256i str = _mm256_loadu_si256((const __m256i*)in);
+    __m256i hi_nibbles = _mm256_and_si256(_mm256_srli_epi32(str, 4), mask_2f);
+    __m256i lo_nibbles = _mm256_and_si256(str, mask_2f);
+    __m256i hi = _mm256_shuffle_epi8(lut_hi, hi_nibbles);
+    __m256i lo = _mm256_shuffle_epi8(lut_lo, lo_nibbles);
+    __m256i eq_2f, merged;
+    if (!_mm256_testz_si256(lo, hi)) break;
+    eq_2f = _mm256_cmpeq_epi8(str, mask_2f);
+    str = _mm256_add_epi8(str, _mm256_shuffle_epi8(lut_roll,
+						   _mm256_add_epi8(eq_2f,
+								   hi_nibbles)));
+    merged = _mm256_maddubs_epi16(str, _mm256_set1_epi32(0x01400140));
+    str = _mm256_madd_epi16(merged, _mm256_set1_epi32(0x00011000));
+    str = _mm256_shuffle_epi8(str, _mm256_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8,
+						    14, 13, 12, -1, -1, -1, -1,
+						    2, 1, 0, 6, 5, 4, 10, 9, 8,
+						    14, 13, 12, -1, -1, -1, -1));
+    /* Move the 12 bytes of each lane next to each other */
+    str = _mm256_permutevar8x32_epi32(str, _mm256_setr_epi32(0, 1, 2, 4, 5, 6,
+							     7, 7));
+    _mm256_storeu_si256((__m256i*)out, str);
+    in += 32;
+    len -= 32;
+    out += 24;
+  }
+  /* Finish with 128 bit operations */
+  while(len >= 24) {
+    __m128i str = _mm_loadu_si128((const __m128i*)in);
+    if (!dec_translate_ssse3(&str)) break;
+    _mm_storeu_si128((__m128i*)out, dec_reshuffle_ssse3(str));
+    in += 16;
+    len -= 16;
+    out += 12;
+  }
+  return in - start;
+}
+
+static int
+ssse3_supported(void)
+{
+  __builtin_cpu_init();
+  return __builtin_cpu_supports("ssse3");
+}
+
+static int
+avx2_supported(void)
+{
+  __builtin_cpu_init();
+  return __builtin_cpu_supports("avx2");
+}
+#endif /* BASE64_X86 */
+
+#ifdef BASE64_NEON
+static unsigned int
+encode_neon(uint8_t *out, const uint8_t *in, unsigned int len)
+{
+  uint8_t *start = out;
+  uint8x16x4_t table;
+  table.val[0] = vld1q_u8(base64chars);
+  table.val[1] = vld1q_u8(base64chars + 16);
+  table.val[2] = vld1q_u8(base64chars + 32);
+  table.val[3] = vld1q_u8(base64chars + 48);
+  while(len >= 48) {
+    uint8x16x3_t v = vld3q_u8(in);
+    uint8x16x4_t idx;
+    idx.val[0] = vshrq_n_u8(v.val[0], 2);
+    idx.val[1] = vorrq_u8(vshlq_n_u8(vandq_u8(v.val[0], vdupq_n_u8(0x03)), 4),
+			  vshrq_n_u8(v.val[1], 4));
+    idx.val[2] = vorrq_u8(vshlq_n_u8(vandq_u8(v.val[1], vdupq_n_u8(0x0f)), 2),
+			  vshrq_n_u8(v.val[2], 6));
+    idx.val[3] = vandq_u8(v.val[2], vdupq_n_u8(0x3f));
+    idx.val[0] = vqtbl4q_u8(table, idx.val[0]);
+    idx.val[1] = vqtbl4q_u8(table, idx.val[1]);
+    idx.val[2] = vqtbl4q_u8(table, idx.val[2]);
+    idx.val[3] = vqtbl4q_u8(table, idx.val[3]);
+    vst4q_u8(out, idx);
+    in += 48;
+    len -= 48;
+    out += 64;
+  }
+  return (out - start) + encode_scalar(out, in, len);
+}
+#endif /* BASE64_NEON */
+
+struct Base64Impl
+{
+  const char *name;
+  int (*supported)(void);
+  unsigned int (*encode)(uint8_t *out, const uint8_t *in, unsigned int len);
+  unsigned int (*decode_blocks)(uint8_t *out,
+				const uint8_t *in, unsigned int len);
+};
+
+/* In order of preference */
+static const struct Base64Impl impls[] =
+  {
+#ifdef BASE64_X86
+    {"avx2", avx2_supported, encode_avx2, decode_blocks_avx2},
+    {"ssse3", ssse3_supported, encode_ssse3, decode_blocks_ssse3},
+#endif
+#ifdef BASE64_NEON
+    {"neon", always_supported, encode_neon, decode_blocks_none},
+#endif
+    {"scalar", always_supported, encode_scalar, decode_blocks_none},
+    {NULL, NULL, NULL, NULL}
+  };
+
+static const struct Base64Impl *impl = NULL;
+
+static void
+select_best_impl(void)
+{
+  const struct Base64Impl *i = impls;
+  init_decode_table();
+  while(!i->supported()) i++;
+  impl = i;
+}
+
+unsigned int
+base64_encode(uint8_t *out, const uint8_t *in, unsigned int len)
+{
+  if (!impl) select_best_impl();
+  return impl->encode(out, in, len);
+}
+
+void
+base64_decoder_init(struct Base64Decoder *dec)
+{
+  if (!impl) select_best_impl();
+  dec->n_group = 0;
+  dec->padding = 0;
+}
+
+int
+base64_decode(struct Base64Decoder *dec, uint8_t *out,
+	      const uint8_t *in, unsigned int len)
+{
+  uint8_t *start = out;
+  while(len > 0) {
+    unsigned int n;
+    int w;
+    /* Use the vector decoder whenever a new group starts */
+    if (dec->n_group == 0 && dec->padding == 0) {
+      n = impl->decode_blocks(out, in, len);
+      in += n;
+      len -= n;
+      out += n / 4 * 3;
+      if (len == 0) break;
+    }
+    /* Take the rest of the block that stopped the vector decoder, and
+       continue until a group boundary */
+    n = len < 16 ? len : 16;
+    while(1) {
+      w = decode_scalar(dec, out, in, n);
+      if (w < 0) return -1;
+      in += n;
+      len -= n;
+      out += w;
+      if (len == 0 || dec->n_group == 0) break;
+      n = 1;
+    }
+  }
+  return out - start;
+}
+
+int
+base64_decode_finish(struct Base64Decoder *dec, uint8_t *out)
+{
+  int w = 0;
+  /* Padding that didn't complete the group */
+  if (dec->padding > 0 && dec->n_group > 0) return -1;
+  switch(dec->n_group) {
+  case 0:
+    break;
+  case 1:
+    return -1;
+  case 3:
+    out[1] = (dec->group[1] << 4) | (dec->group[2] >> 2);
+    w++;
+    /* Fall through */
+  case 2:
+    out[0] = (dec->group[0] << 2) | (dec->group[1] >> 4);
+    w++;
+    break;
+  }
+  dec->n_group = 0;
+  return w;
+}
+
+int
+base64_select_impl(const char *name)
+{
+  const struct Base64Impl *i;
+  if (!impl) select_best_impl();
+  for (i = impls; i->name; i++) {
+    if (strcmp(i->name, name) == 0) {
+      if (!i->supported()) return 0;
+      impl = i;
+      return 1;
+    }
+  }
+  return 0;
+}
+
+const char *
+base64_impl_name(void)
+{
+  if (!impl) select_best_impl();
+  return impl->name;
+}
@@ -0,0 +1,53 @@
+#ifndef __BASE64_H__R7XK2M9QWD__
+#define __BASE64_H__R7XK2M9QWD__
+
+#include <stdint.h>
+
+/* Number of bytes needed to encode len bytes, including padding */
+#define BASE64_ENCODED_SIZE(len) (((len) + 2) / 3 * 4)
+
+/* Largest number of bytes decoded from len characters, including
+   what may be left from the previous call */
+#define BASE64_DECODED_MAX(len) (((len) / 4 + 1) * 3)
+
+/* State of a decoder. The input may be split at any point. */
+struct Base64Decoder
+{
+  uint8_t group[4]; /* Values of an incomplete group */
+  unsigned int n_group;
+  unsigned int padding; /* Number of '=' seen. Only '=' may follow. */
+};
+
+/* Encode len bytes from in to out. out must have room for
+   BASE64_ENCODED_SIZE(len) bytes and must not overlap in. Returns the
+   number of bytes written. The fastest implementation supported by the
+   CPU is selected on the first call. */
+unsigned int
+base64_encode(uint8_t *out, const uint8_t *in, unsigned int len);
+
+/* Force a specific implementation ("scalar", "ssse3", "avx2" or
+   "neon"). Returns 0 if it isn't available on this CPU or build. */
+int
+base64_select_impl(const char *name);
+
+void
+base64_decoder_init(struct Base64Decoder *dec);
+
+/* Decode len characters from in to out. out must have room for
+   BASE64_DECODED_MAX(len) bytes. Whitespace is skipped. Returns the
+   number of bytes written or -1 if the input is malformed. */
+int
+base64_decode(struct Base64Decoder *dec, uint8_t *out,
+	      const uint8_t *in, unsigned int len);
+
+/* Decode what is left of an unpadded last group. out must have room
+   for 2 bytes. Returns the number of bytes written or -1 if the input
+   ended in the middle of a group. */
+int
+base64_decode_finish(struct Base64Decoder *dec, uint8_t *out);
+
+/* Name of the implementation currently in use */
+const char *
+base64_impl_name(void);
+
+#endif /* __BASE64_H__R7XK2M9QWD__ */
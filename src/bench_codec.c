@@ -0,0 +1,716 @@
+/* Micro benchmarks for the encoding and decoding of messages
+
+   Usage: bench_codec [-j] [-t ms] [-f filter] [-c corpus]...
+
+   -j         Print one JSON object per line instead of a table
+   -t ms      Minimum time spent on each benchmark (default 200)
+   -f filter  Only run benchmarks whose name contains filter
+   -c corpus  Also run the requests in a file of native messaging
+	      frames, e.g. recorded from the standard input of the host
+*/
+#include <base64.h>
+#include <json_parse.h>
+#include <protocol_keys.h>
+#include <native_message.h>
+#include <scratch_protocol.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <x86intrin.h>
+#define HAVE_CYCLES
+#endif
+
+/* Minimum time spent on each benchmark */
+static double bench_ns = 200000000.0;
+#define BENCH_NS bench_ns
+
+static int json_output = 0;
+static const char *filter = NULL;
+
+static double
+now_ns(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/* Time stamp counter, or 0 where there is none */
+static uint64_t
+now_cycles(void)
+{
+#ifdef HAVE_CYCLES
+  return __rdtsc();
+#else
+  return 0;
+#endif
+}
+
+/* Cycle count at the start of the running benchmark */
+static uint64_t start_cycles;
+
+#define BENCH_START() (start_cycles = now_cycles(), now_ns())
+
+/* Keeps the compiler from optimizing away results */
+static volatile unsigned int sink;
+
+static int
+selected(const char *name)
+{
+  return !filter || strstr(name, filter);
+}
+
+/* size is the number of bytes handled by each operation, 0 if that
+   isn't meaningful */
+static void
+report(const char *name, const char *impl, unsigned int size,
+       unsigned long ops, double ns)
+{
+  double cycles = (double)(now_cycles() - start_cycles);
+  double bytes = (double)size * ops;
+  if (json_output) {
+    printf("{\"bench\":\"%s\",\"impl\":\"%s\",\"size\":%u,"
+	   "\"ops\":%lu,\"ns_per_op\":%.2f,\"bytes_per_s\":%.0f",
+	   name, impl, size, ops, ns / ops, bytes * 1e9 / ns);
+#ifdef HAVE_CYCLES
+    if (size > 0) {
+      printf(",\"cycles_per_byte\":%.3f", cycles / bytes);
+    } else {
+      printf(",\"cycles_per_op\":%.1f", cycles / ops);
+    }
+#endif
+    printf("}\n");
+  } else {
+    printf("%-16s %-12s %8u bytes %10.1f ns/op %10.1f MB/s",
+	   name, impl, size, ns / ops, bytes * 1e3 / ns);
+#ifdef HAVE_CYCLES
+    if (size > 0) printf(" %8.3f c/B", cycles / bytes);
+#endif
+    printf("\n");
+  }
+  fflush(stdout);
+}
+
+static void
+bench_base64_encode(const char *impl, unsigned int size)
+{
+  uint8_t *in = malloc(size);
+  uint8_t *out = malloc(BASE64_ENCODED_SIZE(size));
+  unsigned long ops = 0;
+  unsigned int i;
+  double start, elapsed;
+  if (!base64_select_impl(impl)) {
+    free(in);
+    free(out);
+    return;
+  }
+  for (i = 0; i < size; i++) in[i] = rand();
+  start = BENCH_START();
+  do {
+    for (i = 0; i < 100; i++) {
+      sink += base64_encode(out, in, size);
+    }
+    ops += 100;
+    elapsed = now_ns() - start;
+  } while(elapsed < BENCH_NS);
+  report("base64_encode", impl, size, ops, elapsed);
+  free(in);
+  free(out);
+}
+
+static void
+bench_base64_decode(const char *impl, unsigned int size)
+{
+  uint8_t *data = malloc(size);
+  uint8_t *in = malloc(BASE64_ENCODED_SIZE(size));
+  uint8_t *out = malloc(BASE64_DECODED_MAX(BASE64_ENCODED_SIZE(size)));
+  struct Base64Decoder dec;
+  unsigned int in_len;
+  unsigned long ops = 0;
+  unsigned int i;
+  double start, elapsed;
+  for (i = 0; i < size; i++) data[i] = rand();
+  in_len = base64_encode(in, data, size);
+  if (base64_select_impl(impl)) {
+    start = BENCH_START();
+    do {
+      for (i = 0; i < 100; i++) {
+	base64_decoder_init(&dec);
+	sink += base64_decode(&dec, out, in, in_len);
+      }
+      ops += 100;
+      elapsed = now_ns() - start;
+    } while(elapsed < BENCH_NS);
+    report("base64_decode", impl, size, ops, elapsed);
+  }
+  free(data);
+  free(in);
+  free(out);
+}
+
+static int
+count_cb(const uint8_t *block, unsigned int len, void *cb_data)
+{
+  *(unsigned int*)cb_data += len;
+  return 1;
+}
+
+/* A quoted base64 string of size characters, like the payload of
+   serial_send_raw */
+static void
+bench_json_string(const char *impl, unsigned int size)
+{
+  uint8_t *data = malloc(size);
+  uint8_t *in = aligned_alloc(64, ((BASE64_ENCODED_SIZE(size) + 3
+				   + JSON_PARSE_PADDING + 63) / 64 * 64));
+  const uint8_t *p;
+  unsigned int len;
+  unsigned long ops = 0;
+  unsigned int i;
+  double start, elapsed;
+  for (i = 0; i < size; i++) data[i] = rand();
+  in[0] = '"';
+  len = base64_encode(in + 1, data, size / 4 * 3);
+  in[len + 1] = '"';
+  in[len + 2] = '\0';
+  if (json_select_impl(impl)) {
+    start = BENCH_START();
+    do {
+      for (i = 0; i < 100; i++) {
+	unsigned int n = 0;
+	p = in;
+	json_parse_string(&p, count_cb, &n);
+	sink += n;
+      }
+      ops += 100;
+      elapsed = now_ns() - start;
+    } while(elapsed < BENCH_NS);
+    report("json_string", impl, size, ops, elapsed);
+  }
+  free(data);
+  free(in);
+}
+
+/* Whitespace between values, as in pretty printed JSON */
+static void
+bench_json_white(const char *impl, unsigned int size)
+{
+  uint8_t *in = aligned_alloc(64, (size + 2 + JSON_PARSE_PADDING + 63) / 64 * 64);
+  const uint8_t *p;
+  unsigned long ops = 0;
+  unsigned int i;
+  double start, elapsed;
+  for (i = 0; i < size; i++) in[i] = " \t\n\r"[rand() & 3];
+  in[size] = '1';
+  in[size + 1] = '\0';
+  if (json_select_impl(impl)) {
+    start = BENCH_START();
+    do {
+      for (i = 0; i < 100; i++) {
+	p = in;
+	json_skip_white(&p);
+	sink += p - in;
+      }
+      ops += 100;
+      elapsed = now_ns() - start;
+    } while(elapsed < BENCH_NS);
+    report("json_skip_white", impl, size, ops, elapsed);
+  }
+  free(in);
+}
+
+/* Numbers as they appear in serial_open_raw options and config files */
+static const char *int_mix[] =
+  {"9600", "115200", "8", "1", "0", "4096", "1048576", "-1",
+   "2000000", "9223372036854775807", NULL};
+
+static int
+strtol_parse(const uint8_t **pp, long *value)
+{
+  const uint8_t *end;
+  *value = strtol((const char*)*pp, (char**)&end, 10);
+  if (*pp == end) return 0;
+  *pp = end;
+  return 1;
+}
+
+static void
+bench_int(const char *impl, int (*parse)(const uint8_t **pp, long *value))
+{
+  uint8_t *in[10];
+  unsigned long ops = 0;
+  unsigned int total = 0;
+  unsigned int n;
+  unsigned int i;
+  double start, elapsed;
+  /* Each number is followed by a delimiter and padding */
+  for (n = 0; int_mix[n]; n++) {
+    in[n] = calloc(1, strlen(int_mix[n]) + 2 + JSON_PARSE_PADDING);
+    strcpy((char*)in[n], int_mix[n]);
+    in[n][strlen(int_mix[n])] = ',';
+    total += strlen(int_mix[n]);
+  }
+  start = BENCH_START();
+  do {
+    for (i = 0; i < 100; i++) {
+      const uint8_t *p = in[i % n];
+      long v;
+      parse(&p, &v);
+      sink += v;
+    }
+    ops += 100;
+    elapsed = now_ns() - start;
+  } while(elapsed < BENCH_NS);
+  report("json_parse_int", impl, total / n, ops, elapsed);
+  for (i = 0; i < n; i++) free(in[i]);
+}
+
+/* The command lookup used before protocol_keys.c */
+static const char *linear_commands[] =
+  {"version", "serial_list", "serial_open_raw", "serial_close",
+   "serial_send_raw", "stats", "capabilities", NULL};
+
+static int
+linear_lookup(const char *command)
+{
+  const char **c;
+  for (c = linear_commands; *c; c++) {
+    if (strcmp(command, *c) == 0) return c - linear_commands;
+  }
+  return -1;
+}
+
+/* Look up every command in turn, as a mix of requests would */
+static void
+bench_dispatch(const char *impl, int (*lookup)(const char *key))
+{
+  unsigned long ops = 0;
+  unsigned int i;
+  double start, elapsed;
+  start = BENCH_START();
+  do {
+    for (i = 0; i < 100; i++) {
+      sink += lookup(scratch_command_names[i % SCRATCH_CMD_COUNT]);
+    }
+    ops += 100;
+    elapsed = now_ns() - start;
+  } while(elapsed < BENCH_NS);
+  report("command_lookup", impl, 0, ops, elapsed);
+}
+
+static int
+skip_value_cb(const uint8_t **pp, const char *key, void *cb_data)
+{
+  struct JSONValue value;
+  if (!json_parse_value(pp, &value)) return 0;
+  switch(value.type) {
+  case JSON_STRING:
+    return json_skip_string(pp);
+  case JSON_ARRAY:
+  case JSON_OBJECT:
+    return 0;
+  }
+  return 1;
+}
+
+/* The options object of serial_open_raw */
+static void
+bench_json_object(void)
+{
+  static const char options[] =
+    "{\"bitRate\":115200,\"bufferSize\":4096,\"ctsFlowControl\":1,"
+    "\"dataBits\":8,\"parityBit\":0,\"stopBits\":1}";
+  uint8_t *in = calloc(1, sizeof(options) + JSON_PARSE_PADDING);
+  char key[20];
+  unsigned long ops = 0;
+  unsigned int i;
+  double start, elapsed;
+  memcpy(in, options, sizeof(options));
+  start = BENCH_START();
+  do {
+    for (i = 0; i < 100; i++) {
+      const uint8_t *p = in;
+      sink += json_iterate_object(&p, key, sizeof(key), skip_value_cb, NULL);
+    }
+    ops += 100;
+    elapsed = now_ns() - start;
+  } while(elapsed < BENCH_NS);
+  report("json_object", "options", sizeof(options) - 1, ops, elapsed);
+  free(in);
+}
+
+/* A host with a single serial port that accepts everything. Requests
+   go through native_message_input, replies are discarded. */
+static const char *bench_ports[] = {"/dev/bench", NULL};
+static int bench_port;
+
+static const char **
+bench_get_ports(void *context)
+{
+  return bench_ports;
+}
+
+static int
+bench_open(const char *port, struct SerialOpts *opts, void *context)
+{
+  return strcmp(port, bench_ports[0]) == 0;
+}
+
+static int
+bench_close(const char *port, void *context)
+{
+  return strcmp(port, bench_ports[0]) == 0;
+}
+
+static void *
+bench_find(const char *port, void *context)
+{
+  return strcmp(port, bench_ports[0]) == 0 ? &bench_port : NULL;
+}
+
+static unsigned int
+bench_write_size(void *port, void *context)
+{
+  return 4096;
+}
+
+static int
+bench_write(void *port, const uint8_t *data, unsigned int len, void *context)
+{
+  sink += len;
+  return 1;
+}
+
+static const struct ScratchSerialCallbacks bench_serial_callbacks =
+  {
+    bench_get_ports,
+    bench_open,
+    bench_close,
+    bench_find,
+    bench_write_size,
+    bench_write
+  };
+
+static void
+bench_message(const uint8_t *msg, unsigned int len, void *context)
+{
+  scratch_protocol_message_handler(context, msg, len);
+}
+
+static int
+bench_stream_begin(const uint8_t *start, unsigned int start_len,
+		   void *context)
+{
+  return scratch_protocol_stream_begin(context, start, start_len);
+}
+
+static void
+bench_stream_data(const uint8_t *data, unsigned int len, int last,
+		  void *context)
+{
+  scratch_protocol_stream_data(context, data, len, last);
+}
+
+static long
+bench_output(const struct NativeMessageFrame *frames, unsigned int offset,
+	     void *context)
+{
+  long total = 0;
+  while(frames) {
+    total += frames->len - offset;
+    offset = 0;
+    frames = frames->next;
+  }
+  return total;
+}
+
+static const struct NativeMessageCallbacks bench_nm_callbacks =
+  {
+    bench_message,
+    bench_output,
+    bench_stream_begin,
+    bench_stream_data
+  };
+
+struct BenchHost
+{
+  struct NativeMessage nm;
+  struct ScratchProtocol sp;
+  int saved_stderr;
+};
+
+/* The protocol logs every request. That is sent to /dev/null while
+   the host is running. */
+static int
+host_init(struct BenchHost *host)
+{
+  int null = open("/dev/null", O_WRONLY);
+  if (!native_message_init(&host->nm, &bench_nm_callbacks, &host->sp)) {
+    return 0;
+  }
+  scratch_protocol_init(&host->sp, &host->nm, &bench_serial_callbacks, NULL);
+  fflush(stderr);
+  host->saved_stderr = dup(2);
+  if (null >= 0) {
+    dup2(null, 2);
+    close(null);
+  }
+  return 1;
+}
+
+static void
+host_destroy(struct BenchHost *host)
+{
+  fflush(stderr);
+  dup2(host->saved_stderr, 2);
+  close(host->saved_stderr);
+  scratch_protocol_destroy(&host->sp);
+  native_message_destroy(&host->nm);
+}
+
+/* Pass frames to the host the way reads from stdin would */
+static void
+host_input(struct BenchHost *host, const uint8_t *data, unsigned int len)
+{
+  while(len > 0) {
+    uint8_t *buffer;
+    unsigned int n = native_message_get_input_buffer(&host->nm, &buffer);
+    if (n > NM_INPUT_READ_SIZE) n = NM_INPUT_READ_SIZE;
+    if (n > len) n = len;
+    memcpy(buffer, data, n);
+    native_message_input(&host->nm, n);
+    data += n;
+    len -= n;
+  }
+  native_message_flush(&host->nm);
+}
+
+/* Handle a corpus of n_frames native messaging frames per operation */
+static void
+bench_requests(const char *impl, const uint8_t *frames, unsigned int len,
+	       unsigned int n_frames)
+{
+  struct BenchHost host;
+  unsigned long ops = 0;
+  unsigned int i;
+  double start, elapsed;
+  if (!host_init(&host)) return;
+  start = BENCH_START();
+  do {
+    for (i = 0; i < 10; i++) {
+      host_input(&host, frames, len);
+    }
+    ops += 10;
+    elapsed = now_ns() - start;
+  } while(elapsed < BENCH_NS);
+  host_destroy(&host);
+  report("request", impl, len / n_frames, ops * n_frames, elapsed);
+}
+
+/* Append a frame holding msg to a corpus */
+static uint8_t *
+add_frame(uint8_t *frames, unsigned int *len, const char *msg)
+{
+  uint32_t msg_len = strlen(msg);
+  frames = realloc(frames, *len + 4 + msg_len);
+  memcpy(frames + *len, &msg_len, 4);
+  memcpy(frames + *len + 4, msg, msg_len);
+  *len += 4 + msg_len;
+  return frames;
+}
+
+/* serial_send_raw with size bytes of data */
+static void
+bench_send_raw(const char *impl, unsigned int size)
+{
+  uint8_t *data = malloc(size);
+  char *msg = malloc(BASE64_ENCODED_SIZE(size) + 100);
+  uint8_t *frames = NULL;
+  unsigned int len = 0;
+  unsigned int i;
+  int n;
+  for (i = 0; i < size; i++) data[i] = rand();
+  n = sprintf(msg, "[\"1\",[\"serial_send_raw\",\"%s\",\"", bench_ports[0]);
+  n += base64_encode((uint8_t*)msg + n, data, size);
+  strcpy(msg + n, "\"]]");
+  frames = add_frame(frames, &len, msg);
+  bench_requests(impl, frames, len, 1);
+  free(frames);
+  free(msg);
+  free(data);
+}
+
+/* Small control requests as sent when a device is opened */
+static void
+bench_control(void)
+{
+  static const char *requests[] =
+    {"[\"1\",[\"version\"]]",
+     "[\"2\",[\"serial_list\"]]",
+     "[\"3\",[\"serial_open_raw\",\"/dev/bench\","
+     "{\"bitRate\":115200,\"bufferSize\":4096}]]",
+     "[\"4\",[\"capabilities\",{\"binary\":false}]]",
+     "[\"5\",[\"serial_close\",\"/dev/bench\"]]",
+     NULL};
+  uint8_t *frames = NULL;
+  unsigned int len = 0;
+  unsigned int n;
+  for (n = 0; requests[n]; n++) {
+    frames = add_frame(frames, &len, requests[n]);
+  }
+  bench_requests("control", frames, len, n);
+  free(frames);
+}
+
+/* A recorded corpus */
+static void
+bench_corpus(const char *file_name)
+{
+  FILE *file = fopen(file_name, "rb");
+  uint8_t *frames = NULL;
+  unsigned int len = 0;
+  unsigned int n = 0;
+  unsigned int pos;
+  const char *impl = strrchr(file_name, '/');
+  if (!file) {
+    fprintf(stderr, "Failed to open corpus %s\n", file_name);
+    return;
+  }
+  while(1) {
+    uint8_t *f = realloc(frames, len + 65536);
+    size_t r;
+    if (!f) break;
+    frames = f;
+    r = fread(frames + len, 1, 65536, file);
+    if (r == 0) break;
+    len += r;
+  }
+  fclose(file);
+  /* Count the frames and drop a truncated one at the end */
+  for (pos = 0; pos + 4 <= len; n++) {
+    uint32_t msg_len;
+    memcpy(&msg_len, frames + pos, 4);
+    if (msg_len > len - pos - 4) break;
+    pos += 4 + msg_len;
+  }
+  if (n > 0) bench_requests(impl ? impl + 1 : file_name, frames, pos, n);
+  free(frames);
+}
+
+/* The serialRecv message sent for size bytes received from a port.
+   This is what native_message_append_base64 is used for. */
+static void
+bench_serial_recv(unsigned int size)
+{
+  struct NativeMessage nm;
+  uint8_t *data = malloc(size);
+  unsigned long ops = 0;
+  unsigned int i;
+  double start, elapsed;
+  for (i = 0; i < size; i++) data[i] = rand();
+  if (!native_message_init(&nm, &bench_nm_callbacks, NULL)) return;
+  start = BENCH_START();
+  do {
+    for (i = 0; i < 100; i++) {
+      native_message_append_str(&nm, "[\"serialRecv\",\"/dev/bench\",\"");
+      native_message_append_base64(&nm, data, size);
+      native_message_append_str(&nm, "\"]");
+      native_message_send_data(&nm);
+      native_message_flush(&nm);
+    }
+    ops += 100;
+    elapsed = now_ns() - start;
+  } while(elapsed < BENCH_NS);
+  report("serial_recv", "base64", size, ops, elapsed);
+  native_message_destroy(&nm);
+  free(data);
+}
+
+int
+main(int argc, char *argv[])
+{
+  static const char *json_impls[] = {"scalar", "sse2", "avx2", NULL};
+  static const char *impls[] = {"scalar", "ssse3", "avx2", "neon", NULL};
+  static const unsigned int sizes[] = {16, 256, 64*1024, 0};
+  const char **e;
+  const unsigned int *s;
+  int opt;
+  while((opt = getopt(argc, argv, "jt:f:c:")) != -1) {
+    switch(opt) {
+    case 'j':
+      json_output = 1;
+      break;
+    case 't':
+      bench_ns = atof(optarg) * 1e6;
+      break;
+    case 'f':
+      filter = optarg;
+      break;
+    case 'c':
+      break; /* Run last */
+    default:
+      fprintf(stderr,
+	      "Usage: %s [-j] [-t ms] [-f filter] [-c corpus]...\n", argv[0]);
+      return EXIT_FAILURE;
+    }
+  }
+  if (selected("base64_encode")) {
+    for (s = sizes; *s; s++) {
+      for (e = impls; *e; e++) {
+	bench_base64_encode(*e, *s);
+      }
+    }
+  }
+  if (selected("base64_decode")) {
+    for (s = sizes; *s; s++) {
+      for (e = impls; *e; e++) {
+	bench_base64_decode(*e, *s);
+      }
+    }
+  }
+  if (selected("json_string")) {
+    for (s = sizes; *s; s++) {
+      for (e = json_impls; *e; e++) {
+	bench_json_string(*e, *s);
+      }
+    }
+  }
+  if (selected("json_skip_white")) {
+    for (s = sizes; *s; s++) {
+      for (e = json_impls; *e; e++) {
+	bench_json_white(*e, *s);
+      }
+    }
+  }
+  /* The rest use the last implementation selected, which is the
+     fastest one available */
+  if (selected("json_object")) bench_json_object();
+  if (selected("json_parse_int")) {
+    bench_int("strtol", strtol_parse);
+    bench_int("swar", json_parse_int);
+  }
+  if (selected("command_lookup")) {
+    bench_dispatch("linear", linear_lookup);
+    bench_dispatch("hash", scratch_command_lookup);
+  }
+  if (selected("serial_recv")) {
+    bench_serial_recv(256);
+    bench_serial_recv(4096);
+  }
+  if (selected("request")) {
+    bench_control();
+    bench_send_raw("send_raw_256", 256);
+    bench_send_raw("send_raw_64k", 64*1024);
+    optind = 1;
+    while((opt = getopt(argc, argv, "jt:f:c:")) != -1) {
+      if (opt == 'c') bench_corpus(optarg);
+    }
+  }
+  return EXIT_SUCCESS;
+}
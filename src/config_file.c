@@ -2,6 +2,8 @@
 #include <stdio.h>
 #include <json_parse.h>
 #include <debug.h>
+#include <native_message.h>
+#include <protocol_keys.h>
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
@@ -64,14 +66,77 @@ conf_param_cb(const uint8_t **pp, const char *key, void *cb_data)
   struct SerialPorts ports;
   ports.serial_ports = cd->serial_ports;
   ports.n_ports = 0;
-  if (strcmp(key, "serial_ports") == 0) {
-    int res = json_iterate_array(pp, serial_port_cb, &ports);
-    cd->serial_ports = ports.serial_ports;
-    if (!res) {
-      PRINTERR("Failed to parse serial port list\n");
-      return 0;
+  switch(config_key_lookup(key)) {
+  case CONFIG_SERIAL_PORTS:
+    {
+      int res = json_iterate_array(pp, serial_port_cb, &ports);
+      cd->serial_ports = ports.serial_ports;
+      if (!res) {
+	PRINTERR("Failed to parse serial port list\n");
+	return 0;
+      }
+    }
+    break;
+  case CONFIG_MAX_MESSAGE_SIZE:
+    {
+      long v;
+      if (!json_parse_int(pp, &v) || v <= 0 || v > NM_INPUT_MAX_LIMIT) {
+	PRINTERR("Failed to parse max_message_size value\n");
+	return 0;
+      }
+      cd->max_message_size = v;
+    }
+    break;
+  case CONFIG_OUTPUT_QUEUE_LIMIT:
+    {
+      long v;
+      if (!json_parse_int(pp, &v) || v <= 0) {
+	PRINTERR("Failed to parse output_queue_limit value\n");
+	return 0;
+      }
+      cd->output_queue_limit = v;
+    }
+    break;
+  case CONFIG_OVERFLOW_POLICY:
+    {
+      char policy[10];
+      if (!json_parse_string_buffer(pp, (uint8_t*)policy, sizeof(policy))) {
+	PRINTERR("Failed to parse overflow_policy value\n");
+	return 0;
+      }
+      if (strcmp(policy, "drop") == 0) {
+	cd->overflow_policy = NM_OVERFLOW_DROP;
+      } else if (strcmp(policy, "merge") == 0) {
+	cd->overflow_policy = NM_OVERFLOW_MERGE;
+      } else if (strcmp(policy, "pause") == 0) {
+	cd->overflow_policy = NM_OVERFLOW_PAUSE;
+      } else {
+	PRINTERR("Unknown overflow policy %s\n", policy);
+	return 0;
+      }
+    }
+    break;
+  case CONFIG_CREDIT_MAX_MESSAGES:
+    {
+      long v;
+      if (!json_parse_int(pp, &v) || v < 0) {
+	PRINTERR("Failed to parse credit_max_messages value\n");
+	return 0;
+      }
+      cd->credit_max_messages = v;
+    }
+    break;
+  case CONFIG_CREDIT_MAX_BYTES:
+    {
+      long v;
+      if (!json_parse_int(pp, &v) || v < 0) {
+	PRINTERR("Failed to parse credit_max_bytes value\n");
+	return 0;
+      }
+      cd->credit_max_bytes = v;
     }
-  } else {
+    break;
+  default:
     PRINTERR("Unknown parameter %s\n", key);
     return 0;
   }
@@ -96,14 +161,15 @@ config_data_read(const char *file_name)
     return NULL;
   }
   
-  read_buffer = malloc(read_capacity);
+  /* The padding isn't counted in read_capacity */
+  read_buffer = malloc(read_capacity + JSON_PARSE_PADDING);
 
   while(1) {
     ssize_t r;
     if (read_capacity - read_len <= 1) {
       uint8_t *b;
       read_capacity *= 2;
-      b = realloc(read_buffer, read_capacity);
+      b = realloc(read_buffer, read_capacity + JSON_PARSE_PADDING);
       if (!b) {
 	free(read_buffer);
 	close(fd);
@@ -132,6 +198,11 @@ config_data_read(const char *file_name)
     return NULL;
   }
   cd->serial_ports = NULL; 
+  cd->max_message_size = 0;
+  cd->output_queue_limit = NM_OUTPUT_DEFAULT_LIMIT;
+  cd->overflow_policy = NM_OVERFLOW_MERGE;
+  cd->credit_max_messages = CREDIT_DEFAULT_MAX_MESSAGES;
+  cd->credit_max_bytes = CREDIT_DEFAULT_MAX_BYTES;
   p = read_buffer;
   json_skip_white(&p);
   res = json_iterate_object(&p, key, sizeof(key), conf_param_cb, cd);
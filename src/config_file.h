@@ -2,9 +2,19 @@
 #define __CONFIG_FILE_H__TR0ZK1X4QI__
 
 
+/* Defaults of the credit limits */
+#define CREDIT_DEFAULT_MAX_MESSAGES 1000
+#define CREDIT_DEFAULT_MAX_BYTES (1024*1024)
+
 struct ConfigData
 {
   char **serial_ports;
+  unsigned int max_message_size; /* 0 if not set */
+  unsigned int output_queue_limit;
+  int overflow_policy; /* One of NM_OVERFLOW_* */
+  /* Most credits a client may hold, 0 for no limit */
+  unsigned long credit_max_messages;
+  unsigned long credit_max_bytes;
 };
 
 void
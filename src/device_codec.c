@@ -0,0 +1,19 @@
+#include "device_codec.h"
+#include <firmata.h>
+#include <string.h>
+
+static const struct DeviceCodecClass *const codecs[] =
+  {
+    &firmata_codec,
+    NULL
+  };
+
+const struct DeviceCodecClass *
+device_codec_lookup(const char *name)
+{
+  const struct DeviceCodecClass *const *c;
+  for (c = codecs; *c; c++) {
+    if (strcmp((*c)->name, name) == 0) return *c;
+  }
+  return NULL;
+}
@@ -0,0 +1,35 @@
+#ifndef __DEVICE_CODEC_H__V8QJ3TXH6C__
+#define __DEVICE_CODEC_H__V8QJ3TXH6C__
+
+#include <stdint.h>
+#include <json_emit.h>
+
+/* A codec decodes the data received from a device in the host and
+   keeps the device state. Changes are sent as deviceState messages
+   instead of forwarding the raw data. Each codec embeds struct
+   DeviceCodec as the first member of its own state. */
+struct DeviceCodec
+{
+  const struct DeviceCodecClass *cls;
+};
+
+struct DeviceCodecClass
+{
+  const char *name; /* Value of the codec option of serial_open_raw */
+  /* Returns NULL if there is no memory */
+  struct DeviceCodec *(*create)(void);
+  void (*destroy)(struct DeviceCodec *codec);
+  /* Decode received data. The input may be split at any point. */
+  void (*input)(struct DeviceCodec *codec,
+		const uint8_t *data, unsigned int len);
+  /* True if the state has changed since it was last emitted */
+  int (*changed)(struct DeviceCodec *codec);
+  /* Emit the changes as a JSON object and clear them */
+  int (*emit)(struct DeviceCodec *codec, struct JSONEmitter *je);
+};
+
+/* Returns NULL if there is no codec with that name */
+const struct DeviceCodecClass *
+device_codec_lookup(const char *name);
+
+#endif /* __DEVICE_CODEC_H__V8QJ3TXH6C__ */
@@ -0,0 +1,262 @@
+#include "firmata.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#define DIGITAL_MESSAGE 0x90
+#define ANALOG_MESSAGE 0xe0
+#define REPORT_ANALOG 0xc0
+#define REPORT_DIGITAL 0xd0
+#define SET_PIN_MODE 0xf4
+#define SET_DIGITAL_PIN 0xf5
+#define REPORT_VERSION 0xf9
+#define START_SYSEX 0xf0
+#define END_SYSEX 0xf7
+
+#define STRING_DATA 0x71
+#define REPORT_FIRMWARE 0x79
+
+#define FIRMATA_ANALOG_MAX 16
+#define FIRMATA_PORTS 16 /* 8 pins each */
+#define FIRMATA_SYSEX_MAX 256
+#define FIRMATA_TEXT_MAX 64
+
+/* What has changed, besides the pins */
+#define CHANGED_VERSION 0x01
+#define CHANGED_FIRMWARE 0x02
+#define CHANGED_STRING 0x04
+
+struct FirmataCodec
+{
+  struct DeviceCodec codec;
+  /* Message being received */
+  uint8_t command; /* 0 between messages */
+  unsigned int need; /* Data bytes of command */
+  uint8_t data[FIRMATA_SYSEX_MAX];
+  unsigned int len;
+  /* Values and what was last emitted */
+  uint16_t analog[FIRMATA_ANALOG_MAX];
+  uint16_t analog_sent[FIRMATA_ANALOG_MAX];
+  uint16_t analog_known; /* One bit per channel that has been emitted */
+  uint16_t analog_changed;
+  uint8_t digital[FIRMATA_PORTS];
+  uint8_t digital_sent[FIRMATA_PORTS];
+  uint16_t digital_known;
+  uint16_t digital_changed;
+  unsigned int changed; /* CHANGED_* */
+  uint8_t version[2];
+  char firmware[FIRMATA_TEXT_MAX];
+  char string[FIRMATA_TEXT_MAX]; /* Latest STRING_DATA */
+};
+
+static struct DeviceCodec *
+firmata_create(void)
+{
+  struct FirmataCodec *fc = calloc(1, sizeof(struct FirmataCodec));
+  if (!fc) return NULL;
+  fc->codec.cls = &firmata_codec;
+  return &fc->codec;
+}
+
+static void
+firmata_destroy(struct DeviceCodec *codec)
+{
+  free(codec);
+}
+
+/* Number of data bytes following a command byte */
+static unsigned int
+message_length(uint8_t command)
+{
+  switch(command < START_SYSEX ? command & 0xf0 : command) {
+  case DIGITAL_MESSAGE:
+  case ANALOG_MESSAGE:
+  case SET_PIN_MODE:
+  case SET_DIGITAL_PIN:
+  case REPORT_VERSION:
+    return 2;
+  case REPORT_ANALOG:
+  case REPORT_DIGITAL:
+    return 1;
+  }
+  return 0;
+}
+
+/* Text sent as pairs of 7 bit bytes, least significant first. Only
+   ASCII is kept so that the result is valid JSON. */
+static void
+decode_text(char *text, const uint8_t *data, unsigned int len)
+{
+  unsigned int i;
+  unsigned int n = 0;
+  for (i = 0; i + 1 < len && n < FIRMATA_TEXT_MAX - 1; i += 2) {
+    unsigned int c = data[i] | (data[i + 1] << 7);
+    text[n++] = c < 0x80 ? c : '?';
+  }
+  text[n] = '\0';
+}
+
+static void
+handle_sysex(struct FirmataCodec *fc)
+{
+  if (fc->len == 0) return;
+  switch(fc->data[0]) {
+  case REPORT_FIRMWARE:
+    if (fc->len < 3) return;
+    fc->version[0] = fc->data[1];
+    fc->version[1] = fc->data[2];
+    decode_text(fc->firmware, fc->data + 3, fc->len - 3);
+    fc->changed |= CHANGED_VERSION | CHANGED_FIRMWARE;
+    break;
+  case STRING_DATA:
+    decode_text(fc->string, fc->data + 1, fc->len - 1);
+    fc->changed |= CHANGED_STRING;
+    break;
+  }
+}
+
+static void
+handle_message(struct FirmataCodec *fc)
+{
+  unsigned int value = fc->data[0] | (fc->data[1] << 7);
+  unsigned int n = fc->command & 0x0f;
+  switch(fc->command & 0xf0) {
+  case ANALOG_MESSAGE:
+    fc->analog[n] = value;
+    if (!(fc->analog_known & (1 << n)) || value != fc->analog_sent[n]) {
+      fc->analog_changed |= 1 << n;
+    } else {
+      fc->analog_changed &= ~(1 << n);
+    }
+    return;
+  case DIGITAL_MESSAGE:
+    fc->digital[n] = value;
+    if (!(fc->digital_known & (1 << n)) || value != fc->digital_sent[n]) {
+      fc->digital_changed |= 1 << n;
+    } else {
+      fc->digital_changed &= ~(1 << n);
+    }
+    return;
+  }
+  if (fc->command == REPORT_VERSION) {
+    fc->version[0] = fc->data[0];
+    fc->version[1] = fc->data[1];
+    fc->changed |= CHANGED_VERSION;
+  }
+}
+
+static void
+firmata_input(struct DeviceCodec *codec, const uint8_t *data, unsigned int len)
+{
+  struct FirmataCodec *fc = (struct FirmataCodec*)codec;
+  while(len-- > 0) {
+    uint8_t c = *data++;
+    if (c & 0x80) {
+      if (c == END_SYSEX && fc->command == START_SYSEX) handle_sysex(fc);
+      fc->command = c;
+      fc->need = message_length(c);
+      fc->len = 0;
+      if (fc->need == 0 && c != START_SYSEX) fc->command = 0;
+    } else if (fc->command == START_SYSEX) {
+      /* Overlong sysex messages are truncated */
+      if (fc->len < FIRMATA_SYSEX_MAX) fc->data[fc->len++] = c;
+    } else if (fc->command != 0) {
+      fc->data[fc->len++] = c;
+      if (fc->len == fc->need) {
+	handle_message(fc);
+	fc->len = 0; /* Running status, the command may be left out */
+      }
+    }
+  }
+}
+
+static int
+firmata_changed(struct DeviceCodec *codec)
+{
+  struct FirmataCodec *fc = (struct FirmataCodec*)codec;
+  return fc->analog_changed || fc->digital_changed || fc->changed;
+}
+
+static int
+emit_number_key(struct JSONEmitter *je, unsigned int n)
+{
+  char key[12];
+  snprintf(key, sizeof(key), "%u", n);
+  return json_emit_key(je, key);
+}
+
+static void
+emit_digital(struct FirmataCodec *fc, struct JSONEmitter *je)
+{
+  unsigned int p;
+  for (p = 0; p < FIRMATA_PORTS; p++) {
+    unsigned int bits;
+    unsigned int b;
+    if (!(fc->digital_changed & (1 << p))) continue;
+    /* Every pin the first time, then only those that differ */
+    bits = ((fc->digital_known & (1 << p))
+	    ? fc->digital[p] ^ fc->digital_sent[p] : 0xff);
+    for (b = 0; b < 8; b++) {
+      if (!(bits & (1 << b))) continue;
+      emit_number_key(je, p * 8 + b);
+      json_emit_uint(je, (fc->digital[p] >> b) & 1);
+    }
+    fc->digital_sent[p] = fc->digital[p];
+  }
+  fc->digital_known |= fc->digital_changed;
+  fc->digital_changed = 0;
+}
+
+static int
+firmata_emit(struct DeviceCodec *codec, struct JSONEmitter *je)
+{
+  struct FirmataCodec *fc = (struct FirmataCodec*)codec;
+  unsigned int i;
+  if (!json_emit_object_begin(je)) return 0;
+  if (fc->analog_changed) {
+    json_emit_key(je, "analog");
+    json_emit_object_begin(je);
+    for (i = 0; i < FIRMATA_ANALOG_MAX; i++) {
+      if (!(fc->analog_changed & (1 << i))) continue;
+      emit_number_key(je, i);
+      json_emit_uint(je, fc->analog[i]);
+      fc->analog_sent[i] = fc->analog[i];
+    }
+    json_emit_object_end(je);
+    fc->analog_known |= fc->analog_changed;
+    fc->analog_changed = 0;
+  }
+  if (fc->digital_changed) {
+    json_emit_key(je, "digital");
+    json_emit_object_begin(je);
+    emit_digital(fc, je);
+    json_emit_object_end(je);
+  }
+  if (fc->changed & CHANGED_VERSION) {
+    char version[12];
+    snprintf(version, sizeof(version), "%u.%u",
+	     fc->version[0], fc->version[1]);
+    json_emit_key(je, "version");
+    json_emit_string(je, version);
+  }
+  if (fc->changed & CHANGED_FIRMWARE) {
+    json_emit_key(je, "firmware");
+    json_emit_string(je, fc->firmware);
+  }
+  if (fc->changed & CHANGED_STRING) {
+    json_emit_key(je, "string");
+    json_emit_string(je, fc->string);
+  }
+  fc->changed = 0;
+  return json_emit_object_end(je);
+}
+
+const struct DeviceCodecClass firmata_codec =
+  {
+    "firmata",
+    firmata_create,
+    firmata_destroy,
+    firmata_input,
+    firmata_changed,
+    firmata_emit
+  };
@@ -0,0 +1,15 @@
+#ifndef __FIRMATA_H__N2GW7KRC5Y__
+#define __FIRMATA_H__N2GW7KRC5Y__
+
+#include <device_codec.h>
+
+/* Decodes Firmata analog, digital, version, firmware and string
+   messages. The state is emitted as
+
+   {"analog":{"<channel>":<value>,...},"digital":{"<pin>":0|1,...},
+    "version":"<major>.<minor>","firmware":"<name>","string":"<text>"}
+
+   with only the members that have changed. */
+extern const struct DeviceCodecClass firmata_codec;
+
+#endif /* __FIRMATA_H__N2GW7KRC5Y__ */
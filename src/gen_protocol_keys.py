@@ -0,0 +1,249 @@
+#!/usr/bin/env python3
+# Generate protocol_keys.c and protocol_keys.h from protocol_keys.def
+#
+# Usage: gen_protocol_keys.py protocol_keys.def <output base name>
+#
+# Each key table gets a perfect hash: a seed is searched for so that
+# FNV-1a of every key lands in a different slot. A lookup is then one
+# hash and one strcmp.
+
+import sys
+
+ARG_TYPES = {
+    "path": "char %s[SCRATCH_PATH_MAX]",
+    "string": "int %s",
+    "object": "int %s",
+    "array": "int %s",
+    "int": "long %s",
+}
+
+def fnv1a(seed, key):
+    h = 2166136261 ^ seed
+    for c in key.encode():
+        h ^= c
+        h = (h * 16777619) & 0xffffffff
+    return h
+
+def perfect_hash(keys):
+    size = 1
+    while size < len(keys):
+        size *= 2
+    while True:
+        for seed in range(100000):
+            slots = set(fnv1a(seed, k) & (size - 1) for k in keys)
+            if len(slots) == len(keys):
+                return seed, size
+        size *= 2
+
+def camel(name):
+    return "".join(p.capitalize() for p in name.split("_"))
+
+def parse_def(path):
+    tables = {"command": [], "serial_opt": [], "poll_opt": [], "config": []}
+    args = {}
+    for lineno, line in enumerate(open(path), 1):
+        line = line.split("#", 1)[0].split()
+        if not line:
+            continue
+        kind, name = line[0], line[1]
+        if kind not in tables:
+            sys.exit("%s:%d: unknown table %s" % (path, lineno, kind))
+        tables[kind].append(name)
+        if kind == "command":
+            args[name] = []
+            for a in line[2:]:
+                aname, atype = a.split(":")
+                optional = atype.endswith("?")
+                atype = atype.rstrip("?")
+                if atype not in ARG_TYPES:
+                    sys.exit("%s:%d: unknown type %s" % (path, lineno, atype))
+                if optional and atype not in ("string", "object", "array"):
+                    sys.exit("%s:%d: %s can't be optional"
+                             % (path, lineno, atype))
+                args[name].append((aname, atype, optional))
+    return tables, args
+
+# C names of the tables: (enum, constant prefix, lookup function)
+TABLES = [
+    ("command", "ScratchCommand", "SCRATCH_CMD_", "scratch_command"),
+    ("serial_opt", "SerialOptKey", "SERIAL_OPT_", "serial_opt"),
+    ("poll_opt", "PollOptKey", "POLL_OPT_", "poll_opt"),
+    ("config", "ConfigKey", "CONFIG_", "config_key"),
+]
+
+def tabify(lines):
+    """Indent with tabs for every 8 columns, like the rest of the code"""
+    out = []
+    for line in lines:
+        stripped = line.lstrip(" ")
+        n = len(line) - len(stripped)
+        out.append("\t" * (n // 8) + " " * (n % 8) + stripped)
+    return "\n".join(out) + "\n"
+
+def gen_header(tables, args):
+    out = []
+    w = out.append
+    w("/* Generated by gen_protocol_keys.py from protocol_keys.def."
+      " Do not edit. */")
+    w("#ifndef __PROTOCOL_KEYS_H__G5MT2WQX8N__")
+    w("#define __PROTOCOL_KEYS_H__G5MT2WQX8N__")
+    w("")
+    w("#include <json_index.h>")
+    w("")
+    w("/* Size of path arguments, including the terminating '\\0' */")
+    w("#define SCRATCH_PATH_MAX 50")
+    for kind, enum, prefix, func in TABLES:
+        w("")
+        w("enum %s" % enum)
+        w("{")
+        for k in tables[kind]:
+            w("  %s%s," % (prefix, k.upper()))
+        w("  %sCOUNT" % prefix)
+        w("};")
+        w("")
+        w("/* Returns one of %s* or -1 if the key is unknown */" % prefix)
+        w("int")
+        w("%s_lookup(const char *key);" % func)
+        w("")
+        w("extern const char *const %s_names[];" % func)
+    w("")
+    w("/* Arguments of each command */")
+    for cmd in tables["command"]:
+        if not args[cmd]:
+            continue
+        w("")
+        w("struct ScratchArgs%s" % camel(cmd))
+        w("{")
+        for aname, atype, optional in args[cmd]:
+            w("  %s;" % (ARG_TYPES[atype] % aname))
+        w("};")
+    w("")
+    w("union ScratchArgs")
+    w("{")
+    w("  int none; /* Commands without arguments */")
+    for cmd in tables["command"]:
+        if args[cmd]:
+            w("  struct ScratchArgs%s %s;" % (camel(cmd), cmd))
+    w("};")
+    w("")
+    w("/* Parse the arguments of a command. array is the index entry of the")
+    w("   command array, the arguments start at its second element. Returns")
+    w("   0 if an argument is missing or has the wrong type. */")
+    w("int")
+    w("scratch_args_parse(int command, const struct JSONIndex *idx, int array,")
+    w("                   union ScratchArgs *args);")
+    w("")
+    w("#endif /* __PROTOCOL_KEYS_H__G5MT2WQX8N__ */")
+    return tabify(out)
+
+def gen_source(tables, args):
+    out = []
+    w = out.append
+    w("/* Generated by gen_protocol_keys.py from protocol_keys.def."
+      " Do not edit. */")
+    w("#include \"protocol_keys.h\"")
+    w("#include <string.h>")
+    w("#include <debug.h>")
+    w("")
+    w("static uint32_t")
+    w("key_hash(uint32_t seed, const char *key)")
+    w("{")
+    w("  uint32_t h = 2166136261u ^ seed;")
+    w("  while(*key) {")
+    w("    h ^= (uint8_t)*key++;")
+    w("    h *= 16777619u;")
+    w("  }")
+    w("  return h;")
+    w("}")
+    for kind, enum, prefix, func in TABLES:
+        keys = tables[kind]
+        seed, size = perfect_hash(keys)
+        slots = [-1] * size
+        for i, k in enumerate(keys):
+            slots[fnv1a(seed, k) & (size - 1)] = i
+        w("")
+        w("const char *const %s_names[] =" % func)
+        w("  {")
+        for k in keys:
+            w("    \"%s\"," % k)
+        w("    NULL")
+        w("  };")
+        w("")
+        w("static const signed char %s_slots[%d] =" % (func, size))
+        w("  {")
+        for i in range(0, size, 8):
+            w("    " + " ".join("%d," % s for s in slots[i:i + 8]))
+        w("  };")
+        w("")
+        w("int")
+        w("%s_lookup(const char *key)" % func)
+        w("{")
+        w("  int i = %s_slots[key_hash(%du, key) & %d];" % (func, seed, size - 1))
+        w("  if (i < 0 || strcmp(key, %s_names[i]) != 0) return -1;" % func)
+        w("  return i;")
+        w("}")
+    for cmd in tables["command"]:
+        if not args[cmd]:
+            continue
+        w("")
+        w("static int")
+        w("parse_%s(const struct JSONIndex *idx, int array," % cmd)
+        w("%sstruct ScratchArgs%s *args)" % (" " * (len(cmd) + 7), camel(cmd)))
+        w("{")
+        w("  int e;")
+        for n, (aname, atype, optional) in enumerate(args[cmd]):
+            w("  e = json_index_array_get(idx, array, %d);" % (n + 1))
+            if optional:
+                w("  args->%s = -1;" % aname)
+                w("  if (e >= 0) {")
+                ind = "    "
+            else:
+                w("  if (e < 0) {")
+                w("    PRINTERR(\"%s: missing argument %s\\n\");" % (cmd, aname))
+                w("    return 0;")
+                w("  }")
+                ind = "  "
+            if atype == "path":
+                first = ind + "if (!json_index_get_string("
+                w(first + "idx, e, args->%s," % aname)
+                w(" " * len(first) + "sizeof(args->%s))) {" % aname)
+            elif atype == "int":
+                w(ind + "if (!json_index_get_int(idx, e, &args->%s)) {" % aname)
+            else:
+                w(ind + "if (json_index_type(idx, e) != JSON_%s) {"
+                  % atype.upper())
+            w(ind + "  PRINTERR(\"%s: %s must be a%s %s\\n\");"
+              % (cmd, aname, "n" if atype[0] in "aeiou" else "",
+                 "string" if atype == "path" else atype))
+            w(ind + "  return 0;")
+            w(ind + "}")
+            if atype in ("string", "object", "array"):
+                w(ind + "args->%s = e;" % aname)
+            if optional:
+                w("  }")
+        w("  return 1;")
+        w("}")
+    w("")
+    w("int")
+    w("scratch_args_parse(int command, const struct JSONIndex *idx, int array,")
+    w("                   union ScratchArgs *args)")
+    w("{")
+    w("  switch(command) {")
+    for cmd in tables["command"]:
+        if args[cmd]:
+            w("  case SCRATCH_CMD_%s:" % cmd.upper())
+            w("    return parse_%s(idx, array, &args->%s);" % (cmd, cmd))
+    w("  default:")
+    w("    return 1;")
+    w("  }")
+    w("}")
+    return tabify(out)
+
+def main():
+    if len(sys.argv) != 3:
+        sys.exit("Usage: %s <def file> <output base name>" % sys.argv[0])
+    tables, args = parse_def(sys.argv[1])
+    open(sys.argv[2] + ".h", "w").write(gen_header(tables, args))
+    open(sys.argv[2] + ".c", "w").write(gen_source(tables, args))
+
+main()
@@ -0,0 +1,261 @@
+#include "json_emit.h"
+#include <base64.h>
+#include <stdio.h>
+#include <string.h>
+
+/* Second character of the escape sequence for each byte, 'u' for
+   \u00XX or 0 if the byte is copied as is */
+static const uint8_t escape_table[256] =
+  {
+    'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u',
+    'b', 't', 'n', 'u', 'f', 'r', 'u', 'u',
+    'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u',
+    'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u',
+    0, 0, '"', 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, '\\', 0, 0, 0
+    /* The rest is 0 */
+  };
+
+static const char hex_digits[] = "0123456789abcdef";
+
+/* Escape a single byte. out must have room for 6 bytes. */
+static unsigned int
+escape_byte(uint8_t *out, uint8_t c)
+{
+  uint8_t e = escape_table[c];
+  out[0] = '\\';
+  out[1] = e;
+  if (e != 'u') return 2;
+  out[2] = '0';
+  out[3] = '0';
+  out[4] = hex_digits[c >> 4];
+  out[5] = hex_digits[c & 0x0f];
+  return 6;
+}
+
+/* Length of the leading run of bytes that need no escaping */
+static unsigned int
+clean_run(const uint8_t *str, unsigned int len)
+{
+  unsigned int n = 0;
+  while(n < len && !escape_table[str[n]]) n++;
+  return n;
+}
+
+unsigned int
+json_escape(uint8_t *out, const uint8_t *str, unsigned int len)
+{
+  uint8_t *start = out;
+  *out++ = '"';
+  while(len > 0) {
+    unsigned int run = clean_run(str, len);
+    memcpy(out, str, run);
+    out += run;
+    if (run == len) break;
+    out += escape_byte(out, str[run]);
+    str += run + 1;
+    len -= run + 1;
+  }
+  *out++ = '"';
+  return out - start;
+}
+
+static int
+append(struct NativeMessage *nm, const void *data, unsigned int len)
+{
+  uint8_t *out = native_message_reserve(nm, len);
+  if (!out) return 0;
+  memcpy(out, data, len);
+  native_message_commit(nm, len);
+  return 1;
+}
+
+static int
+append_byte(struct NativeMessage *nm, uint8_t c)
+{
+  return append(nm, &c, 1);
+}
+
+/* Quoted and escaped. Clean runs are copied in one go. */
+static int
+append_string(struct NativeMessage *nm, const uint8_t *str, unsigned int len)
+{
+  uint8_t *out;
+  if (!append_byte(nm, '"')) return 0;
+  while(len > 0) {
+    unsigned int run = clean_run(str, len);
+    if (run > 0 && !append(nm, str, run)) return 0;
+    if (run == len) break;
+    out = native_message_reserve(nm, 6);
+    if (!out) return 0;
+    native_message_commit(nm, escape_byte(out, str[run]));
+    str += run + 1;
+    len -= run + 1;
+  }
+  return append_byte(nm, '"');
+}
+
+/* Insert a comma if this isn't the first value at the current level */
+static int
+before_value(struct JSONEmitter *je)
+{
+  uint32_t bit = (uint32_t)1 << je->depth;
+  if (je->after_key) {
+    je->after_key = 0;
+    return 1;
+  }
+  if (je->need_comma & bit) return append_byte(je->nm, ',');
+  je->need_comma |= bit;
+  return 1;
+}
+
+void
+json_emit_init(struct JSONEmitter *je, struct NativeMessage *nm)
+{
+  je->nm = nm;
+  json_emit_reset(je);
+}
+
+void
+json_emit_reset(struct JSONEmitter *je)
+{
+  je->depth = 0;
+  je->need_comma = 0;
+  je->after_key = 0;
+}
+
+static int
+begin(struct JSONEmitter *je, uint8_t c)
+{
+  if (je->depth + 1 >= JSON_EMIT_MAX_DEPTH) return 0;
+  if (!before_value(je) || !append_byte(je->nm, c)) return 0;
+  je->depth++;
+  je->need_comma &= ~((uint32_t)1 << je->depth);
+  return 1;
+}
+
+static int
+end(struct JSONEmitter *je, uint8_t c)
+{
+  if (je->depth == 0) return 0;
+  je->depth--;
+  return append_byte(je->nm, c);
+}
+
+int
+json_emit_array_begin(struct JSONEmitter *je)
+{
+  return begin(je, '[');
+}
+
+int
+json_emit_array_end(struct JSONEmitter *je)
+{
+  return end(je, ']');
+}
+
+int
+json_emit_object_begin(struct JSONEmitter *je)
+{
+  return begin(je, '{');
+}
+
+int
+json_emit_object_end(struct JSONEmitter *je)
+{
+  return end(je, '}');
+}
+
+int
+json_emit_key(struct JSONEmitter *je, const char *key)
+{
+  if (!before_value(je)) return 0;
+  if (!append_string(je->nm, (const uint8_t*)key, strlen(key))) return 0;
+  if (!append_byte(je->nm, ':')) return 0;
+  je->after_key = 1;
+  return 1;
+}
+
+int
+json_emit_string(struct JSONEmitter *je, const char *str)
+{
+  return json_emit_string_len(je, (const uint8_t*)str, strlen(str));
+}
+
+int
+json_emit_string_len(struct JSONEmitter *je,
+		     const uint8_t *str, unsigned int len)
+{
+  if (!before_value(je)) return 0;
+  return append_string(je->nm, str, len);
+}
+
+/* Digits are written backwards from the end of a buffer */
+static int
+append_uint(struct NativeMessage *nm, unsigned long value, int negative)
+{
+  uint8_t buffer[24];
+  uint8_t *p = buffer + sizeof(buffer);
+  do {
+    *--p = '0' + value % 10;
+    value /= 10;
+  } while(value > 0);
+  if (negative) *--p = '-';
+  return append(nm, p, buffer + sizeof(buffer) - p);
+}
+
+int
+json_emit_int(struct JSONEmitter *je, long value)
+{
+  if (!before_value(je)) return 0;
+  if (value < 0) {
+    return append_uint(je->nm, -(unsigned long)value, 1);
+  }
+  return append_uint(je->nm, value, 0);
+}
+
+int
+json_emit_uint(struct JSONEmitter *je, unsigned long value)
+{
+  if (!before_value(je)) return 0;
+  return append_uint(je->nm, value, 0);
+}
+
+int
+json_emit_bool(struct JSONEmitter *je, int value)
+{
+  if (!before_value(je)) return 0;
+  return value ? append(je->nm, "true", 4) : append(je->nm, "false", 5);
+}
+
+int
+json_emit_fixed(struct JSONEmitter *je, double value, unsigned int decimals)
+{
+  char buffer[64];
+  int len;
+  if (!before_value(je)) return 0;
+  len = snprintf(buffer, sizeof(buffer), "%.*f", decimals, value);
+  if (len < 0 || len >= (int)sizeof(buffer)) {
+    return append(je->nm, "0", 1); /* Too large to be useful */
+  }
+  return append(je->nm, buffer, len);
+}
+
+int
+json_emit_base64(struct JSONEmitter *je,
+		 const uint8_t *data, unsigned int len)
+{
+  if (!before_value(je)) return 0;
+  if (!append_byte(je->nm, '"')) return 0;
+  if (!native_message_append_base64(je->nm, data, len)) return 0;
+  return append_byte(je->nm, '"');
+}
+
+int
+json_emit_raw(struct JSONEmitter *je, const char *json)
+{
+  if (!before_value(je)) return 0;
+  return append(je->nm, json, strlen(json));
+}
@@ -0,0 +1,81 @@
+#ifndef __JSON_EMIT_H__W2HC7RJ5LA__
+#define __JSON_EMIT_H__W2HC7RJ5LA__
+
+#include <stdint.h>
+#include <native_message.h>
+
+/* Maximum nesting of arrays and objects */
+#define JSON_EMIT_MAX_DEPTH 32
+
+/* Largest number of bytes json_escape writes for len input bytes,
+   including the quotes */
+#define JSON_ESCAPED_MAX(len) ((len) * 6 + 2)
+
+/* Writes JSON values to the current message of a NativeMessage,
+   inserting commas between values. All functions return 0 if the
+   message couldn't be extended. */
+struct JSONEmitter
+{
+  struct NativeMessage *nm;
+  unsigned int depth;
+  uint32_t need_comma; /* One bit per level */
+  int after_key; /* The next value belongs to a key */
+};
+
+void
+json_emit_init(struct JSONEmitter *je, struct NativeMessage *nm);
+
+/* Start over at the top level, for a new message */
+void
+json_emit_reset(struct JSONEmitter *je);
+
+int
+json_emit_array_begin(struct JSONEmitter *je);
+
+int
+json_emit_array_end(struct JSONEmitter *je);
+
+int
+json_emit_object_begin(struct JSONEmitter *je);
+
+int
+json_emit_object_end(struct JSONEmitter *je);
+
+int
+json_emit_key(struct JSONEmitter *je, const char *key);
+
+int
+json_emit_string(struct JSONEmitter *je, const char *str);
+
+int
+json_emit_string_len(struct JSONEmitter *je,
+		     const uint8_t *str, unsigned int len);
+
+int
+json_emit_int(struct JSONEmitter *je, long value);
+
+int
+json_emit_uint(struct JSONEmitter *je, unsigned long value);
+
+int
+json_emit_bool(struct JSONEmitter *je, int value);
+
+/* A number with a fixed number of decimals */
+int
+json_emit_fixed(struct JSONEmitter *je, double value, unsigned int decimals);
+
+/* Encode data as a base64 string */
+int
+json_emit_base64(struct JSONEmitter *je,
+		 const uint8_t *data, unsigned int len);
+
+/* Insert text that is already valid JSON as a value */
+int
+json_emit_raw(struct JSONEmitter *je, const char *json);
+
+/* Write str as a quoted JSON string to out, which must have room for
+   JSON_ESCAPED_MAX(len) bytes. Returns the number of bytes written. */
+unsigned int
+json_escape(uint8_t *out, const uint8_t *str, unsigned int len);
+
+#endif /* __JSON_EMIT_H__W2HC7RJ5LA__ */
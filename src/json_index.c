@@ -0,0 +1,262 @@
+#include "json_index.h"
+#include <stdlib.h>
+#include <string.h>
+
+#define INITIAL_ENTRIES 64
+
+void
+json_index_init(struct JSONIndex *idx)
+{
+  idx->text = NULL;
+  idx->entries = NULL;
+  idx->n_entries = 0;
+  idx->capacity = 0;
+}
+
+void
+json_index_destroy(struct JSONIndex *idx)
+{
+  free(idx->entries);
+  json_index_init(idx);
+}
+
+/* Returns the index of a new entry or -1 if out of memory */
+static int
+new_entry(struct JSONIndex *idx, const uint8_t *p)
+{
+  struct JSONIndexEntry *entry;
+  if (idx->n_entries == idx->capacity) {
+    unsigned int capacity = idx->capacity ? idx->capacity * 2 : INITIAL_ENTRIES;
+    struct JSONIndexEntry *entries;
+    entries = realloc(idx->entries, capacity * sizeof(struct JSONIndexEntry));
+    if (!entries) return -1;
+    idx->entries = entries;
+    idx->capacity = capacity;
+  }
+  entry = &idx->entries[idx->n_entries];
+  entry->offset = p - idx->text;
+  entry->count = 0;
+  entry->type = JSON_NO_TYPE;
+  return idx->n_entries++;
+}
+
+/* Returns JSON_INTEGER or JSON_NUMBER if there is a number at *pp,
+   otherwise JSON_NO_TYPE */
+static int
+skip_number(const uint8_t **pp)
+{
+  const uint8_t *p = *pp;
+  int type = JSON_INTEGER;
+  if (*p == '-') p++;
+  if (*p < '0' || *p > '9') return JSON_NO_TYPE;
+  while(*p >= '0' && *p <= '9') p++;
+  if (*p == '.') {
+    p++;
+    if (*p < '0' || *p > '9') return JSON_NO_TYPE;
+    while(*p >= '0' && *p <= '9') p++;
+    type = JSON_NUMBER;
+  }
+  if (*p == 'e' || *p == 'E') {
+    p++;
+    if (*p == '+' || *p == '-') p++;
+    if (*p < '0' || *p > '9') return JSON_NO_TYPE;
+    while(*p >= '0' && *p <= '9') p++;
+    type = JSON_NUMBER;
+  }
+  *pp = p;
+  return type;
+}
+
+static int
+index_value(struct JSONIndex *idx, const uint8_t **pp, unsigned int depth)
+{
+  const uint8_t *p = *pp;
+  struct JSONValue value;
+  unsigned int count = 0;
+  int e = new_entry(idx, p);
+  if (e < 0) return 0;
+  switch(*p) {
+  case '"':
+    idx->entries[e].type = JSON_STRING;
+    if (!json_skip_string(&p)) return 0;
+    break;
+  case '[':
+    idx->entries[e].type = JSON_ARRAY;
+    if (depth >= JSON_INDEX_MAX_DEPTH) return 0;
+    p++;
+    json_skip_white(&p);
+    if (*p != ']') {
+      while(1) {
+	if (!index_value(idx, &p, depth + 1)) return 0;
+	count++;
+	json_skip_white(&p);
+	if (*p == ']') break;
+	if (*p != ',') return 0;
+	p++;
+	json_skip_white(&p);
+      }
+    }
+    p++;
+    break;
+  case '{':
+    idx->entries[e].type = JSON_OBJECT;
+    if (depth >= JSON_INDEX_MAX_DEPTH) return 0;
+    p++;
+    json_skip_white(&p);
+    if (*p != '}') {
+      while(1) {
+	if (*p != '"') return 0;
+	if (!index_value(idx, &p, depth + 1)) return 0;
+	json_skip_white(&p);
+	if (*p != ':') return 0;
+	p++;
+	json_skip_white(&p);
+	if (!index_value(idx, &p, depth + 1)) return 0;
+	count += 2;
+	json_skip_white(&p);
+	if (*p == '}') break;
+	if (*p != ',') return 0;
+	p++;
+	json_skip_white(&p);
+      }
+    }
+    p++;
+    break;
+  case 't':
+  case 'f':
+  case 'n':
+    if (!json_parse_value(&p, &value)) return 0;
+    idx->entries[e].type = value.type;
+    break;
+  default:
+    idx->entries[e].type = skip_number(&p);
+    if (idx->entries[e].type == JSON_NO_TYPE) return 0;
+    break;
+  }
+  idx->entries[e].count = count;
+  idx->entries[e].next = idx->n_entries;
+  *pp = p;
+  return 1;
+}
+
+int
+json_index_build(struct JSONIndex *idx, const uint8_t *text)
+{
+  const uint8_t *p = text;
+  idx->text = text;
+  idx->n_entries = 0;
+  json_skip_white(&p);
+  if (!index_value(idx, &p, 0)) return 0;
+  json_skip_white(&p);
+  return *p == '\0';
+}
+
+int
+json_index_child(const struct JSONIndex *idx, int e)
+{
+  return idx->entries[e].count > 0 ? e + 1 : -1;
+}
+
+int
+json_index_next(const struct JSONIndex *idx, int p, int e)
+{
+  unsigned int next = idx->entries[e].next;
+  return next < idx->entries[p].next ? (int)next : -1;
+}
+
+int
+json_index_array_get(const struct JSONIndex *idx, int e, unsigned int n)
+{
+  int c;
+  if (idx->entries[e].type != JSON_ARRAY || n >= idx->entries[e].count) {
+    return -1;
+  }
+  c = e + 1;
+  while(n-- > 0) c = idx->entries[c].next;
+  return c;
+}
+
+int
+json_index_object_get(const struct JSONIndex *idx, int e, const char *key)
+{
+  int k;
+  if (idx->entries[e].type != JSON_OBJECT) return -1;
+  for (k = json_index_child(idx, e); k >= 0;
+       k = json_index_next(idx, e, idx->entries[k].next)) {
+    if (json_index_string_equal(idx, k, key)) return idx->entries[k].next;
+  }
+  return -1;
+}
+
+int
+json_index_get_int(const struct JSONIndex *idx, int e, long *value)
+{
+  const uint8_t *p = json_index_text(idx, e);
+  if (idx->entries[e].type != JSON_INTEGER) return 0;
+  return json_parse_int(&p, value);
+}
+
+int
+json_index_get_u32(const struct JSONIndex *idx, int e, uint32_t *value)
+{
+  const uint8_t *p = json_index_text(idx, e);
+  if (idx->entries[e].type != JSON_INTEGER) return 0;
+  return json_parse_u32(&p, value);
+}
+
+int
+json_index_get_u8(const struct JSONIndex *idx, int e, uint8_t *value)
+{
+  const uint8_t *p = json_index_text(idx, e);
+  if (idx->entries[e].type != JSON_INTEGER) return 0;
+  return json_parse_u8(&p, value);
+}
+
+int
+json_index_get_fixed(const struct JSONIndex *idx, int e,
+		     unsigned int decimals, int64_t *value)
+{
+  const uint8_t *p = json_index_text(idx, e);
+  if (idx->entries[e].type != JSON_INTEGER
+      && idx->entries[e].type != JSON_NUMBER) {
+    return 0;
+  }
+  return json_parse_fixed(&p, decimals, value);
+}
+
+int
+json_index_get_bool(const struct JSONIndex *idx, int e, int *value)
+{
+  if (idx->entries[e].type != JSON_BOOLEAN) return 0;
+  *value = *json_index_text(idx, e) == 't';
+  return 1;
+}
+
+int
+json_index_get_string(const struct JSONIndex *idx, int e,
+		      char *buffer, unsigned int len)
+{
+  const uint8_t *p = json_index_text(idx, e);
+  if (idx->entries[e].type != JSON_STRING) return 0;
+  return json_parse_string_buffer(&p, (uint8_t*)buffer, len);
+}
+
+static int
+compare_cb(const uint8_t *block, unsigned int len, void *cb_data)
+{
+  const char **str = cb_data;
+  /* The block never contains '\0', so this also fails if str is
+     shorter */
+  if (strncmp(*str, (const char*)block, len) != 0) return 0;
+  *str += len;
+  return 1;
+}
+
+int
+json_index_string_equal(const struct JSONIndex *idx, int e, const char *str)
+{
+  const uint8_t *p = json_index_text(idx, e);
+  if (idx->entries[e].type != JSON_STRING) return 0;
+  if (!json_parse_string(&p, compare_cb, &str)) return 0;
+  return *str == '\0';
+}
@@ -0,0 +1,94 @@
+#ifndef __JSON_INDEX_H__K3VQ8ZP1TB__
+#define __JSON_INDEX_H__K3VQ8ZP1TB__
+
+#include <stdint.h>
+#include <json_parse.h>
+
+/* Maximum nesting of arrays and objects */
+#define JSON_INDEX_MAX_DEPTH 32
+
+/* One entry per value in the text, in document order. The children of
+   an array or object follow it directly. For objects the children
+   alternate between key and value. */
+struct JSONIndexEntry
+{
+  uint32_t offset; /* Start of the value in the text */
+  uint32_t next; /* First entry after the value and all its children */
+  uint32_t count; /* Number of children */
+  uint8_t type; /* JSON_STRING, JSON_ARRAY etc. */
+};
+
+/* The entries are kept between calls to json_index_build, so an index
+   can be reused for every message without allocating. */
+struct JSONIndex
+{
+  const uint8_t *text;
+  struct JSONIndexEntry *entries;
+  unsigned int n_entries;
+  unsigned int capacity;
+};
+
+void
+json_index_init(struct JSONIndex *idx);
+
+void
+json_index_destroy(struct JSONIndex *idx);
+
+/* Index the NUL terminated text. The text must stay unchanged while
+   the index is used. Returns 0 if it isn't valid JSON, or if there is
+   anything but whitespace after the first value. The root value is
+   entry 0. */
+int
+json_index_build(struct JSONIndex *idx, const uint8_t *text);
+
+#define json_index_type(idx, e) ((idx)->entries[e].type)
+#define json_index_count(idx, e) ((idx)->entries[e].count)
+#define json_index_text(idx, e) ((idx)->text + (idx)->entries[e].offset)
+
+/* Returns entry n of an array, or -1 if e isn't an array or is too
+   short */
+int
+json_index_array_get(const struct JSONIndex *idx, int e, unsigned int n);
+
+/* Returns the value for key in an object, or -1 if e isn't an object
+   or doesn't contain the key */
+int
+json_index_object_get(const struct JSONIndex *idx, int e, const char *key);
+
+/* First child of an array or object. Returns -1 if there is none. */
+int
+json_index_child(const struct JSONIndex *idx, int e);
+
+/* Entry after e within its parent p. Returns -1 if e is the last one. */
+int
+json_index_next(const struct JSONIndex *idx, int p, int e);
+
+/* Typed access. Each returns 0 if the entry has the wrong type or the
+   value doesn't fit. */
+int
+json_index_get_int(const struct JSONIndex *idx, int e, long *value);
+
+int
+json_index_get_u32(const struct JSONIndex *idx, int e, uint32_t *value);
+
+int
+json_index_get_u8(const struct JSONIndex *idx, int e, uint8_t *value);
+
+/* An integer or a number with a fraction, see json_parse_fixed */
+int
+json_index_get_fixed(const struct JSONIndex *idx, int e,
+		     unsigned int decimals, int64_t *value);
+
+int
+json_index_get_bool(const struct JSONIndex *idx, int e, int *value);
+
+/* Copies the decoded string including a terminating '\0' */
+int
+json_index_get_string(const struct JSONIndex *idx, int e,
+		      char *buffer, unsigned int len);
+
+/* Returns 1 if e is a string equal to str */
+int
+json_index_string_equal(const struct JSONIndex *idx, int e, const char *str);
+
+#endif /* __JSON_INDEX_H__K3VQ8ZP1TB__ */
@@ -1,6 +1,214 @@
 #include "json_parse.h"
 #include <stdlib.h>
 #include <string.h>
+#include <limits.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define JSON_X86
+#include <immintrin.h>
+#endif
+
+#define IS_WHITE(c) ((c) == ' ' || (c) == '\t' || (c) == '\n' || (c) == '\r')
+
+/* The vector scanners read the first block unaligned at the start of
+   the text and aligned blocks after that. Nothing before the start is
+   read, but up to 31 bytes after the terminating '\0' may be, which
+   JSON_PARSE_PADDING makes room for. */
+
+/* Returns a pointer to the first '"', '\\' or '\0' */
+static const uint8_t *
+scan_string_scalar(const uint8_t *p)
+{
+  while (*p != '"' && *p != '\\' && *p != '\0') p++;
+  return p;
+}
+
+/* Returns a pointer to the first character that isn't whitespace */
+static const uint8_t *
+skip_white_scalar(const uint8_t *p)
+{
+  while(IS_WHITE(*p)) p++;
+  return p;
+}
+
+#ifdef JSON_X86
+__attribute__((target("sse2")))
+static inline unsigned int
+special_mask_sse2(__m128i v)
+{
+  __m128i m = _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('"')),
+			   _mm_cmpeq_epi8(v, _mm_set1_epi8('\\')));
+  m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_setzero_si128()));
+  return _mm_movemask_epi8(m);
+}
+
+__attribute__((target("sse2")))
+static inline unsigned int
+white_mask_sse2(__m128i v)
+{
+  __m128i m = _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8(' ')),
+			   _mm_cmpeq_epi8(v, _mm_set1_epi8('\t')));
+  m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8('\n')));
+  m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8('\r')));
+  return _mm_movemask_epi8(m);
+}
+
+__attribute__((target("sse2")))
+static const uint8_t *
+scan_string_sse2(const uint8_t *p)
+{
+  const uint8_t *a;
+  unsigned int mask = special_mask_sse2(_mm_loadu_si128((const __m128i*)p));
+  if (mask != 0) return p + __builtin_ctz(mask);
+  a = (const uint8_t*)(((uintptr_t)p + 16) & ~(uintptr_t)15);
+  mask = special_mask_sse2(_mm_load_si128((const __m128i*)a));
+  while(mask == 0) {
+    a += 16;
+    mask = special_mask_sse2(_mm_load_si128((const __m128i*)a));
+  }
+  return a + __builtin_ctz(mask);
+}
+
+__attribute__((target("sse2")))
+static const uint8_t *
+skip_white_sse2(const uint8_t *p)
+{
+  const uint8_t *a;
+  unsigned int mask;
+  /* Most runs are short */
+  if (!IS_WHITE(p[0])) return p;
+  if (!IS_WHITE(p[1])) return p + 1;
+  mask = ~white_mask_sse2(_mm_loadu_si128((const __m128i*)p)) & 0xffff;
+  if (mask != 0) return p + __builtin_ctz(mask);
+  a = (const uint8_t*)(((uintptr_t)p + 16) & ~(uintptr_t)15);
+  mask = ~white_mask_sse2(_mm_load_si128((const __m128i*)a)) & 0xffff;
+  while(mask == 0) {
+    a += 16;
+    mask = ~white_mask_sse2(_mm_load_si128((const __m128i*)a)) & 0xffff;
+  }
+  return a + __builtin_ctz(mask);
+}
+
+__attribute__((target("avx2")))
+static inline uint32_t
+special_mask_avx2(__m256i v)
+{
+  __m256i m = _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('"')),
+			      _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\\')));
+  m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, _mm256_setzero_si256()));
+  return _mm256_movemask_epi8(m);
+}
+
+__attribute__((target("avx2")))
+static inline uint32_t
+white_mask_avx2(__m256i v)
+{
+  __m256i m = _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8(' ')),
+			      _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\t')));
+  m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\n')));
+  m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\r')));
+  return _mm256_movemask_epi8(m);
+}
+
+__attribute__((target("avx2")))
+static const uint8_t *
+scan_string_avx2(const uint8_t *p)
+{
+  const uint8_t *a;
+  uint32_t mask = special_mask_avx2(_mm256_loadu_si256((const __m256i*)p));
+  if (mask != 0) return p + __builtin_ctz(mask);
+  a = (const uint8_t*)(((uintptr_t)p + 32) & ~(uintptr_t)31);
+  mask = special_mask_avx2(_mm256_load_si256((const __m256i*)a));
+  while(mask == 0) {
+    a += 32;
+    mask = special_mask_avx2(_mm256_load_si256((const __m256i*)a));
+  }
+  return a + __builtin_ctz(mask);
+}
+
+__attribute__((target("avx2")))
+static const uint8_t *
+skip_white_avx2(const uint8_t *p)
+{
+  const uint8_t *a;
+  uint32_t mask;
+  if (!IS_WHITE(p[0])) return p;
+  if (!IS_WHITE(p[1])) return p + 1;
+  mask = ~white_mask_avx2(_mm256_loadu_si256((const __m256i*)p));
+  if (mask != 0) return p + __builtin_ctz(mask);
+  a = (const uint8_t*)(((uintptr_t)p + 32) & ~(uintptr_t)31);
+  mask = ~white_mask_avx2(_mm256_load_si256((const __m256i*)a));
+  while(mask == 0) {
+    a += 32;
+    mask = ~white_mask_avx2(_mm256_load_si256((const __m256i*)a));
+  }
+  return a + __builtin_ctz(mask);
+}
+
+static int
+sse2_supported(void)
+{
+  __builtin_cpu_init();
+  return __builtin_cpu_supports("sse2");
+}
+
+static int
+avx2_supported(void)
+{
+  __builtin_cpu_init();
+  return __builtin_cpu_supports("avx2");
+}
+#endif /* JSON_X86 */
+
+static int
+always_supported(void)
+{
+  return 1;
+}
+
+struct JSONScanImpl
+{
+  const char *name;
+  int (*supported)(void);
+  const uint8_t *(*scan_string)(const uint8_t *p);
+  const uint8_t *(*skip_white)(const uint8_t *p);
+};
+
+/* In order of preference */
+static const struct JSONScanImpl impls[] =
+  {
+#ifdef JSON_X86
+    {"avx2", avx2_supported, scan_string_avx2, skip_white_avx2},
+    {"sse2", sse2_supported, scan_string_sse2, skip_white_sse2},
+#endif
+    {"scalar", always_supported, scan_string_scalar, skip_white_scalar},
+    {NULL, NULL, NULL, NULL}
+  };
+
+static const struct JSONScanImpl *impl = NULL;
+
+static void
+select_best_impl(void)
+{
+  const struct JSONScanImpl *i = impls;
+  while(!i->supported()) i++;
+  impl = i;
+}
+
+int
+json_select_impl(const char *name)
+{
+  const struct JSONScanImpl *i;
+  for (i = impls; i->name; i++) {
+    if (strcmp(i->name, name) == 0) {
+      if (!i->supported()) return 0;
+      impl = i;
+      return 1;
+    }
+  }
+  return 0;
+}
+
 int
 json_parse_string(const uint8_t **pp, 
 		  int (*callback)(const uint8_t *block, unsigned int len, 
@@ -11,9 +219,10 @@ json_parse_string(const uint8_t **pp,
   const uint8_t *p = *pp;
   if (*p != '"') return 0;
   p++;
+  if (!impl) select_best_impl();
   while(1) {
     start = p;
-    while (*p != '"' && *p != '\\' && *p != '\0') p++;
+    p = impl->scan_string(p);
     if (!callback(start, p - start, cb_data)) return 0;
     if (*p == '\0') return 0;
     if (*p == '"') {
@@ -22,16 +231,18 @@ json_parse_string(const uint8_t **pp,
     }
     p++;
     switch(*p) {
+    case '\0':
+      return 0; /* Don't scan past the end */
     case 'b':
       if (!callback((const uint8_t*)"\b", 1, cb_data)) return 0;
       p++;
       break;
     case 'f':
-      if (callback((const uint8_t*)"\f", 1, cb_data)) return 0;
+      if (!callback((const uint8_t*)"\f", 1, cb_data)) return 0;
       p++;
       break;
     case 'n':
-      if (callback((const uint8_t*)"\n", 1, cb_data)) return 0;
+      if (!callback((const uint8_t*)"\n", 1, cb_data)) return 0;
       p++;
       break;
     case 'r':
@@ -49,13 +260,173 @@ json_parse_string(const uint8_t **pp,
   }
 }
 
+/* Integers are parsed eight digits at a time in a 64 bit word. Like
+   the scanners this may read up to 7 bytes past the end of the
+   number, which the padding allows. */
+
+#define ONES_64 0x0101010101010101ULL
+
+static inline uint64_t
+load_64(const uint8_t *p)
+{
+  uint64_t v;
+  memcpy(&v, p, 8);
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+  v = __builtin_bswap64(v);
+#endif
+  return v;
+}
+
+/* True if all eight bytes are ASCII digits */
+static inline int
+eight_digits(uint64_t v)
+{
+  return (((v & (0xf0 * ONES_64))
+	   | (((v + 0x06 * ONES_64) & (0xf0 * ONES_64)) >> 4))
+	  == 0x33 * ONES_64);
+}
+
+/* Value of eight ASCII digits, the first one in the lowest byte */
+static inline uint32_t
+eight_digits_value(uint64_t v)
+{
+  v = ((v & (0x0f * ONES_64)) * 2561) >> 8;
+  v = ((v & 0x00ff00ff00ff00ffULL) * 6553601) >> 16;
+  return (uint32_t)(((v & 0x0000ffff0000ffffULL) * 42949672960001ULL) >> 32);
+}
+
+#define IS_DIGIT(c) ((uint8_t)((c) - '0') < 10)
+
+/* Largest number of significant digits accepted. Any 19 digit number
+   fits in 64 bits unsigned. */
+#define MAX_DIGITS 19
+
+/* Parse the digits of an unsigned integer. Leading zeros are
+   ignored. Returns 0 if there are no digits or more than MAX_DIGITS
+   significant ones. */
+static int
+parse_digits(const uint8_t **pp, uint64_t *value)
+{
+  const uint8_t *p = *pp;
+  const uint8_t *start;
+  uint64_t v = 0;
+  if (!IS_DIGIT(*p)) return 0;
+  while(*p == '0') p++;
+  start = p;
+  while(eight_digits(load_64(p))) {
+    if (p - start + 8 > MAX_DIGITS) return 0;
+    v = v * 100000000 + eight_digits_value(load_64(p));
+    p += 8;
+  }
+  while(IS_DIGIT(*p)) {
+    if (p - start + 1 > MAX_DIGITS) return 0;
+    v = v * 10 + (*p++ - '0');
+  }
+  *pp = p;
+  *value = v;
+  return 1;
+}
+
+int
+json_parse_int64(const uint8_t **pp, int64_t *value)
+{
+  const uint8_t *p = *pp;
+  int negative = 0;
+  uint64_t v;
+  if (*p == '-') {
+    negative = 1;
+    p++;
+  }
+  if (!parse_digits(&p, &v)) return 0;
+  if (v > (uint64_t)INT64_MAX + negative) return 0;
+  *value = negative ? -v : v;
+  *pp = p;
+  return 1;
+}
+
 int
 json_parse_int(const uint8_t **pp, long *value)
 {
-  const uint8_t *end;
-  *value = strtol((const char*)*pp, (char**)&end, 10);
-  if (*pp == end) return 0;
-  *pp = end;
+  int64_t v;
+  const uint8_t *p = *pp;
+  if (!json_parse_int64(&p, &v)) return 0;
+  if (v < LONG_MIN || v > LONG_MAX) return 0;
+  *value = v;
+  *pp = p;
+  return 1;
+}
+
+static int
+parse_unsigned(const uint8_t **pp, uint64_t max, uint64_t *value)
+{
+  const uint8_t *p = *pp;
+  if (!parse_digits(&p, value) || *value > max) return 0;
+  *pp = p;
+  return 1;
+}
+
+int
+json_parse_u32(const uint8_t **pp, uint32_t *value)
+{
+  uint64_t v;
+  if (!parse_unsigned(pp, UINT32_MAX, &v)) return 0;
+  *value = v;
+  return 1;
+}
+
+int
+json_parse_u16(const uint8_t **pp, uint16_t *value)
+{
+  uint64_t v;
+  if (!parse_unsigned(pp, UINT16_MAX, &v)) return 0;
+  *value = v;
+  return 1;
+}
+
+int
+json_parse_u8(const uint8_t **pp, uint8_t *value)
+{
+  uint64_t v;
+  if (!parse_unsigned(pp, UINT8_MAX, &v)) return 0;
+  *value = v;
+  return 1;
+}
+
+int
+json_parse_fixed(const uint8_t **pp, unsigned int decimals, int64_t *value)
+{
+  static const uint64_t scale[] =
+    {1, 10, 100, 1000, 10000, 100000, 1000000, 10000000, 100000000,
+     1000000000};
+  const uint8_t *p = *pp;
+  int negative = 0;
+  uint64_t v;
+  uint64_t fraction = 0;
+  unsigned int d = 0;
+  if (decimals >= sizeof(scale) / sizeof(scale[0])) return 0;
+  if (*p == '-') {
+    negative = 1;
+    p++;
+  }
+  if (!parse_digits(&p, &v)) return 0;
+  if (*p == '.') {
+    p++;
+    if (!IS_DIGIT(*p)) return 0;
+    while(IS_DIGIT(*p)) {
+      /* Digits beyond the requested precision are truncated */
+      if (d < decimals) {
+	fraction = fraction * 10 + (*p - '0');
+	d++;
+      }
+      p++;
+    }
+  }
+  if (*p == 'e' || *p == 'E') return 0;
+  if (v > ((uint64_t)INT64_MAX + negative) / scale[decimals]) return 0;
+  v = v * scale[decimals] + fraction * scale[decimals - d];
+  if (v > (uint64_t)INT64_MAX + negative) return 0;
+  *value = negative ? -v : v;
+  *pp = p;
   return 1;
 }
 
@@ -133,9 +504,8 @@ json_skip_string(const uint8_t **pp)
 void
 json_skip_white(const uint8_t **pp)
 {
-  const uint8_t *p = *pp;
-  while(*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r') p++;
-  *pp = p;
+  if (!impl) select_best_impl();
+  *pp = impl->skip_white(*pp);
 }
 
 int 
@@ -10,6 +10,12 @@
 #define JSON_ARRAY 4
 #define JSON_OBJECT 5
 #define JSON_NULL 6
+#define JSON_NUMBER 7 /* Not an integer. Only used by json_index. */
+
+/* The text given to the parser must be NUL terminated and the buffer
+   must have at least this many bytes after the NUL. The vector scanners
+   read whole blocks and may pass the end of the text. */
+#define JSON_PARSE_PADDING 32
 
 struct JSONValue
 {
@@ -36,8 +42,29 @@ json_parse_string(const uint8_t **pp,
 				  void *cb_data), 
 		  void *cb_data);
 
+/* Integer parsers. They fail if there are no digits or the value
+   doesn't fit in the result. */
 int
 json_parse_int(const uint8_t **pp, long *value);
+
+int
+json_parse_int64(const uint8_t **pp, int64_t *value);
+
+int
+json_parse_u32(const uint8_t **pp, uint32_t *value);
+
+int
+json_parse_u16(const uint8_t **pp, uint16_t *value);
+
+int
+json_parse_u8(const uint8_t **pp, uint8_t *value);
+
+/* Parse a number with an optional fraction as a fixed point value
+   with the given number of decimals (at most 9), so that 1.5 with 3
+   decimals is 1500. Further decimals are truncated. Exponents are not
+   supported. */
+int
+json_parse_fixed(const uint8_t **pp, unsigned int decimals, int64_t *value);
 int
 json_parse_value(const uint8_t **pp, struct JSONValue *value);
 
@@ -65,6 +92,12 @@ json_iterate_object(const uint8_t **pp,
 int
 json_string_callback(const uint8_t *block, unsigned int len, void *cb_data);
 
+/* Force a specific implementation of the string and whitespace
+   scanners ("scalar", "sse2" or "avx2"). Returns 0 if it isn't
+   available on this CPU or build. The fastest one is used by default. */
+int
+json_select_impl(const char *name);
+
 int
 json_parse_string_buffer(const uint8_t **pp, 
 			 uint8_t *buffer, unsigned int len);
@@ -3,11 +3,16 @@
 #include <stdio.h>
 #include <poll.h>
 #include <stdint.h>
+#include <limits.h>
 #include <unistd.h>
+#include <sys/uio.h>
 #include <stdarg.h>
 #include <string.h>
 #include <errno.h>
 #include <signal.h>
+#include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
 #include <json_parse.h>
 #include <serial_unix.h>
 #include <config_file.h>
@@ -15,6 +20,8 @@
 #include <termios.h>
 #include <native_message.h>
 #include <scratch_protocol.h>
+#include <json_emit.h>
+#include <serial_framing.h>
 
 struct SerialPort
 {
@@ -22,28 +29,106 @@ struct SerialPort
   struct SerialPort **prevp;
   struct pollfd *poll;
   char *path;
+  /* Start of serialRecv messages for this port */
+  char *recv_prefix;
+  unsigned int recv_prefix_len;
+  unsigned int buffer_size; /* From SerialOpts */
+  /* Data read while output is blocked, with NM_OVERFLOW_MERGE */
+  uint8_t *pending;
+  unsigned int pending_len;
+  /* Data held back by coalescing, sent when coalesce_delay
+     microseconds have passed since coalesce_start or the buffer is
+     full. NULL if coalescing is off. */
+  uint8_t *coalesce;
+  unsigned int coalesce_size;
+  unsigned int coalesce_len;
+  uint32_t coalesce_delay;
+  uint64_t coalesce_start;
+  /* Received data is read into read_buffer and split into frames,
+     unless the framing mode is SERIAL_FRAMING_NONE */
+  struct SerialFramer framer;
+  uint8_t *read_buffer;
+  int poll_buffer; /* read_buffer is only there for polling */
+  /* Decodes received data, also read into read_buffer. NULL if the
+     data is sent as is. */
+  struct DeviceCodec *codec;
+  uint32_t codec_interval;
+  uint64_t codec_sent; /* When the state was last sent */
+  /* Last frame sent, with dedup. NULL otherwise. */
+  uint8_t *last_frame;
+  unsigned int last_frame_len;
+  uint64_t last_frame_sent;
+  uint32_t heartbeat;
+  /* Query sent every query.period while polling. What is received
+     after it, up to the end of the response, goes to response. */
+  int polling;
+  struct ScratchPoll query;
+  uint64_t query_next; /* When the next query is due */
+  uint64_t query_sent; /* When the last one was sent */
+  int awaiting; /* The response isn't complete */
+  uint8_t *response;
+  unsigned int response_len;
+  int opening; /* Being opened by a helper thread, poll is NULL */
+  int closing; /* Closed while opening, no longer linked */
  
   struct AppContext *app;
 };
 
+/* A port opened by a helper thread. The thread owns the job until it
+   has written a pointer to it to the completion pipe. */
+struct OpenJob
+{
+  pthread_t thread;
+  struct SerialPort *port;
+  char *path; /* A copy, the port may be destroyed while opening */
+  struct SerialOpts opts;
+  int done_fd; /* Write end of the completion pipe */
+  int fd; /* Result of serial_open */
+  struct ScratchDeferredReply reply;
+};
+
+/* Free a port that isn't linked or polled */
 static void
-serial_port_destroy(struct SerialPort *port)  
+serial_port_free(struct SerialPort *port)
+{
+  free(port->path);
+  free(port->recv_prefix);
+  free(port->pending);
+  free(port->coalesce);
+  serial_framer_destroy(&port->framer);
+  free(port->read_buffer);
+  if (port->codec) port->codec->cls->destroy(port->codec);
+  free(port->response);
+  free(port->last_frame);
+  free(port);
+}
+
+/* Remove the port from the list. An unlinked port can be unlinked
+   again. */
+static void
+serial_port_unlink(struct SerialPort *port)
 {
-  if (port->poll->fd >= 0) {
-    close(port->poll->fd);
-    port->poll->fd = -1; /* Disable polling */
-  }
-  /* Unlink */
   if (port->next) {
     port->next->prevp = port->prevp;
   }
   *port->prevp = port->next;
-  
-  free(port->path);
-  free(port);
+  port->next = NULL;
+  port->prevp = &port->next;
+}
+
+static void
+serial_port_destroy(struct SerialPort *port)  
+{
+  if (port->poll && port->poll->fd >= 0) {
+    close(port->poll->fd);
+    port->poll->fd = -1; /* Disable polling */
+  }
+  serial_port_unlink(port);
+  serial_port_free(port);
 }
+
 		    
-#define MAX_POLL_FDS 8
+#define MAX_POLL_FDS 16
 
 
 /* Return true if more data is expected, otherwise it will be removed
@@ -61,8 +146,15 @@ struct AppContext
   struct NativeMessage nm;
   struct ScratchProtocol sp;
 
+  struct pollfd *stdout_poll;
+  int output_blocked; /* Output queue full, serial input held back */
+  int credit_blocked; /* Out of credits, serialRecv data held back */
+
   struct SerialPort *serial_ports;
   struct ConfigData *config_data;
+
+  int open_done[2]; /* Completion pipe of port open jobs */
+  uint64_t start_time; /* Microseconds, for poll response times */
 };
 
 static void
@@ -80,6 +172,9 @@ clear_polls(struct AppContext *app)
 static void
 app_cleanup(struct AppContext *app)
 {
+  /* Write what is left before exiting */
+  fcntl(STDOUT_FILENO, F_SETFL, fcntl(STDOUT_FILENO, F_GETFL) & ~O_NONBLOCK);
+  native_message_flush(&app->nm);
   while(app->serial_ports) serial_port_destroy(app->serial_ports);
   clear_polls(app);
   scratch_protocol_destroy(&app->sp);
@@ -118,33 +213,535 @@ find_serial_port_by_path(struct SerialPort *port, const char *path)
   return NULL;
 }
 	     
+#define RECV_PREFIX_START "[\"serialRecv\","
+
+/* Write the start of serialRecv messages for path, up to the opening
+   quote of the data, as a NUL terminated string. Returns the length. */
+static unsigned int
+build_recv_prefix(char *prefix, const char *path)
+{
+  uint8_t *p = (uint8_t*)prefix;
+  memcpy(p, RECV_PREFIX_START, sizeof(RECV_PREFIX_START) - 1);
+  p += sizeof(RECV_PREFIX_START) - 1;
+  p += json_escape(p, (const uint8_t*)path, strlen(path));
+  memcpy(p, ",\"", 3);
+  return p + 2 - (uint8_t*)prefix;
+}
+
+/* Largest amount of serial data that fits in one message */
+#define SERIAL_RECV_MAX(port)						\
+  ((NM_OUTPUT_MAX_PAYLOAD - (port)->recv_prefix_len - 2) / 4 * 3)
+
+/* Largest read into the output message. The reservation holds the
+   raw data besides the prefix, the encoded data and the suffix, so it
+   takes 7/3 of the read. */
+#define SERIAL_RECV_DIRECT_MAX(port)					\
+  ((NM_OUTPUT_MAX_PAYLOAD - (port)->recv_prefix_len - 2) / 7 * 3)
+
+/* Largest amount of serial data that fits in one binary frame */
+#define SERIAL_RECV_BINARY_MAX(header_len) \
+  (NM_OUTPUT_MAX_PAYLOAD - (header_len))
+
+/* Queue a SCRATCH_BINARY_RECV frame with up to len bytes. The data is
+   either copied from data or, if data is NULL, read from fd. Returns
+   the number of bytes consumed. */
+static ssize_t
+send_serial_binary(struct SerialPort *port, const uint8_t *data,
+		   unsigned int len, int fd)
+{
+  struct NativeMessage *nm = &port->app->nm;
+  uint8_t header[SCRATCH_BINARY_RECV_HEADER(255)];
+  unsigned int header_len;
+  uint8_t *out;
+  ssize_t r;
+  header_len = scratch_protocol_binary_recv_header(header, port->path);
+  if (header_len == 0) {
+    errno = ENAMETOOLONG;
+    return -1;
+  }
+  if (len > SERIAL_RECV_BINARY_MAX(header_len)) {
+    len = SERIAL_RECV_BINARY_MAX(header_len);
+  }
+  out = native_message_reserve(nm, header_len + len);
+  if (!out) {
+    errno = ENOMEM;
+    return -1;
+  }
+  if (data) {
+    memcpy(out + header_len, data, len);
+    r = len;
+  } else {
+    r = read(fd, out + header_len, len);
+    if (r <= 0) return r;
+  }
+  memcpy(out, header, header_len);
+  native_message_commit(nm, header_len + r);
+  PRINTDEBUG("Serial recv: %u bytes from %s\n", (unsigned int)r, port->path);
+  native_message_send_data(nm);
+  if (!data) port->app->sp.recv_stats.reads++;
+  scratch_protocol_count_recv(&port->app->sp, r);
+  return r;
+}
+
+static void
+send_serial_data(struct SerialPort *port, const uint8_t *data,
+		 unsigned int len)
+{
+  struct AppContext *app = port->app;
+  unsigned int max_chunk = SERIAL_RECV_MAX(port);
+  while(len > 0 && app->sp.binary) {
+    ssize_t sent = send_serial_binary(port, data, len, -1);
+    if (sent <= 0) return;
+    data += sent;
+    len -= sent;
+  }
+  while(len > 0) {
+    unsigned int chunk = len < max_chunk ? len : max_chunk;
+    native_message_append_str(&app->nm, port->recv_prefix);
+    native_message_append_base64(&app->nm, data, chunk);
+    native_message_append_str(&app->nm,"\"]");
+    PRINTDEBUG("Serial recv: %u bytes from %s\n", chunk, port->path);
+    native_message_send_data(&app->nm);
+    scratch_protocol_count_recv(&app->sp, chunk);
+    data += chunk;
+    len -= chunk;
+  }
+}
+
+static uint64_t
+now_us(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* Send the changes of the device state if there are any */
+static void
+codec_send_state(struct SerialPort *port, uint64_t now)
+{
+  if (!port->codec->cls->changed(port->codec)) return;
+  scratch_protocol_send_state(&port->app->sp, port->path, port->codec);
+  port->codec_sent = now;
+}
+
+/* True if frame is the same as the last one sent and the heartbeat
+   interval hasn't passed. Otherwise it is remembered as the last. */
+static int
+frame_unchanged(struct SerialPort *port, const uint8_t *frame,
+		unsigned int len)
+{
+  uint64_t now = now_us();
+  if (port->last_frame_len == len
+      && memcmp(port->last_frame, frame, len) == 0
+      && (port->heartbeat == 0
+	  || now - port->last_frame_sent < port->heartbeat)) {
+    return 1;
+  }
+  memcpy(port->last_frame, frame, len);
+  port->last_frame_len = len;
+  port->last_frame_sent = now;
+  return 0;
+}
+
+static void
+send_frame(const uint8_t *frame, unsigned int len, void *cb_data)
+{
+  struct SerialPort *port = cb_data;
+  if (port->last_frame && frame_unchanged(port, frame, len)) {
+    port->app->sp.recv_stats.frames_suppressed++;
+    port->app->sp.recv_stats.bytes_suppressed += len;
+    return;
+  }
+  send_serial_data(port, frame, len);
+}
+
+static void
+send_poll_response(struct SerialPort *port, uint64_t now)
+{
+  struct AppContext *app = port->app;
+  scratch_protocol_send_poll_response(&app->sp, port->path,
+				      port->response, port->response_len,
+				      port->query_sent - app->start_time,
+				      now - app->start_time);
+  port->awaiting = 0;
+}
+
+/* Add received data to the response of a poll. Returns the number of
+   bytes used, the rest is not part of the response. */
+static unsigned int
+poll_response_input(struct SerialPort *port, const uint8_t *data,
+		    unsigned int len)
+{
+  const struct ScratchPoll *q = &port->query;
+  const uint8_t *end = NULL;
+  unsigned int n = len;
+  unsigned int room = port->buffer_size - port->response_len;
+  if (q->delimiter >= 0) {
+    end = memchr(data, q->delimiter, len);
+    if (end) n = end - data + 1;
+  } else if (q->length > 0 && n > q->length - port->response_len) {
+    n = q->length - port->response_len;
+  }
+  /* Overlong responses are truncated */
+  memcpy(port->response + port->response_len, data, n < room ? n : room);
+  port->response_len += n < room ? n : room;
+  if (end || (q->length > 0 && port->response_len == q->length)) {
+    send_poll_response(port, now_us());
+  }
+  return n;
+}
+
+/* Send the data held back by coalescing, if any */
+static void
+coalesce_flush(struct SerialPort *port, uint64_t now)
+{
+  struct ScratchRecvStats *stats = &port->app->sp.recv_stats;
+  uint64_t delay;
+  if (port->coalesce_len == 0) return;
+  send_serial_data(port, port->coalesce, port->coalesce_len);
+  port->coalesce_len = 0;
+  delay = now - port->coalesce_start;
+  stats->delayed++;
+  stats->delay_total += delay;
+  if (delay > stats->delay_max) stats->delay_max = delay;
+}
+
+/* Add data to the coalescing buffer, sending it each time it fills */
+static void
+coalesce_input(struct SerialPort *port, const uint8_t *data,
+	       unsigned int len)
+{
+  while(len > 0) {
+    unsigned int n = port->coalesce_size - port->coalesce_len;
+    if (n > len) n = len;
+    if (port->coalesce_len == 0) port->coalesce_start = now_us();
+    memcpy(port->coalesce + port->coalesce_len, data, n);
+    port->coalesce_len += n;
+    data += n;
+    len -= n;
+    if (port->coalesce_len == port->coalesce_size) {
+      coalesce_flush(port, now_us());
+    }
+  }
+}
+
+/* Send received data, one message per frame if framing. With a
+   codec, only the state is sent, at most every codec_interval. Data
+   that isn't a poll response is coalesced if the port does that. */
+static void
+deliver_serial_data(struct SerialPort *port, const uint8_t *data,
+		    unsigned int len)
+{
+  struct SerialFramer *f = &port->framer;
+  if (port->awaiting) {
+    unsigned int n = poll_response_input(port, data, len);
+    data += n;
+    len -= n;
+    if (len == 0) return;
+  }
+  if (port->codec) {
+    uint64_t now = now_us();
+    port->codec->cls->input(port->codec, data, len);
+    if (port->codec_interval == 0
+	|| now >= port->codec_sent + port->codec_interval) {
+      codec_send_state(port, now);
+    }
+    return;
+  }
+  if (port->coalesce) {
+    coalesce_input(port, data, len);
+    return;
+  }
+  serial_framer_input(f, data, len, send_frame, port);
+  port->app->sp.recv_stats.frames_dropped += f->dropped;
+  f->dropped = 0;
+}
+
+/* Read directly into the output message. Space is reserved for the
+   prefix, the encoded data and the suffix, followed by a region the
+   raw data is read into. The data is then encoded from that region to
+   its final place, so no intermediate buffer is needed. */
+static ssize_t
+serial_recv_message(struct SerialPort *port, int fd)
+{
+  struct NativeMessage *nm = &port->app->nm;
+  ssize_t r;
+  uint8_t *out;
+  unsigned int read_size = port->buffer_size;
+  unsigned int encoded_size;
+  if (port->app->sp.binary) {
+    return send_serial_binary(port, NULL, read_size, fd);
+  }
+  if (read_size > SERIAL_RECV_DIRECT_MAX(port)) {
+    read_size = SERIAL_RECV_DIRECT_MAX(port);
+  }
+  encoded_size = (read_size + 2) / 3 * 4;
+  out = native_message_reserve(nm, (port->recv_prefix_len + encoded_size + 2
+				    + read_size));
+  if (!out) {
+    errno = ENOMEM;
+    return -1;
+  }
+  r = read(fd, out + port->recv_prefix_len + encoded_size + 2, read_size);
+  if (r <= 0) return r;
+  port->app->sp.recv_stats.reads++;
+  memcpy(out, port->recv_prefix, port->recv_prefix_len);
+  native_message_commit(nm, port->recv_prefix_len);
+  /* Fits in the reserved space, so the message is not moved */
+  native_message_append_base64(nm, (out + port->recv_prefix_len
+				    + encoded_size + 2), r);
+  native_message_append_str(nm,"\"]");
+  PRINTDEBUG("Serial recv: %u bytes from %s\n", (unsigned int)r, port->path);
+  native_message_send_data(nm);
+  scratch_protocol_count_recv(&port->app->sp, r);
+  return r;
+}
+
+/* Read into the read buffer and send the completed frames */
+static ssize_t
+serial_recv_frames(struct SerialPort *port, int fd)
+{
+  ssize_t r = read(fd, port->read_buffer, port->buffer_size);
+  if (r <= 0) return r;
+  port->app->sp.recv_stats.reads++;
+  deliver_serial_data(port, port->read_buffer, r);
+  return r;
+}
+
+/* Read into the coalescing buffer, sending it when full. Returns the
+   number of bytes read, 0 at end of file or -1 on error. */
+static ssize_t
+serial_recv_coalesce(struct SerialPort *port, int fd)
+{
+  ssize_t r;
+  r = read(fd, port->coalesce + port->coalesce_len,
+	   port->coalesce_size - port->coalesce_len);
+  if (r <= 0) return r;
+  port->app->sp.recv_stats.reads++;
+  if (port->coalesce_len == 0) port->coalesce_start = now_us();
+  port->coalesce_len += r;
+  if (port->coalesce_len == port->coalesce_size) {
+    coalesce_flush(port, now_us());
+  }
+  return r;
+}
+
+/* True if received data must be held back, because the output queue
+   is full or the client has no credits left. In the latter case only
+   serialRecv data is held back. */
+static int
+input_blocked(struct AppContext *app)
+{
+  if (!app->credit_blocked && !scratch_protocol_credit_available(&app->sp)) {
+    PRINTDEBUG("Out of credits, holding back serial input\n");
+    app->sp.credit.stalls++;
+    app->credit_blocked = 1;
+  }
+  return app->output_blocked || app->credit_blocked;
+}
+
+/* Time when data held back by the port must be sent, or UINT64_MAX */
+static uint64_t
+port_deadline(struct SerialPort *port)
+{
+  uint64_t deadline = UINT64_MAX;
+  if (port->coalesce_len > 0 && !port->app->credit_blocked) {
+    deadline = port->coalesce_start + port->coalesce_delay;
+  }
+  if (port->codec && port->codec->cls->changed(port->codec)
+      && port->codec_sent + port->codec_interval < deadline) {
+    deadline = port->codec_sent + port->codec_interval;
+  }
+  if (port->polling) {
+    if (port->query_next < deadline) deadline = port->query_next;
+    if (port->awaiting && port->query_sent + port->query.timeout < deadline) {
+      deadline = port->query_sent + port->query.timeout;
+    }
+  }
+  return deadline;
+}
+
+static int 
+unix_serial_write(void *handle, const uint8_t *data, unsigned int len,
+		  void *context)
+{
+  struct SerialPort *port = handle;
+  while(len > 0) {
+    ssize_t written = write(port->poll->fd, data, len);
+    if (written < 0) {
+      if (errno == EINTR) continue;
+      PRINTERR("Failed to write to serial port: %s\n", strerror(errno));
+      return 0;
+    }
+    data += written;
+    len -= written;
+  }
+  return 1;
+}
+
+static void
+poll_timeout(struct SerialPort *port, uint64_t now)
+{
+  const struct ScratchPoll *q = &port->query;
+  if (q->delimiter < 0 && q->length == 0 && port->response_len > 0) {
+    /* Whatever arrived in time is the response */
+    send_poll_response(port, now);
+  } else {
+    port->app->sp.recv_stats.poll_timeouts++;
+    port->awaiting = 0;
+  }
+}
+
+static void
+poll_send_query(struct SerialPort *port, uint64_t now)
+{
+  struct ScratchRecvStats *stats = &port->app->sp.recv_stats;
+  uint64_t late = now - port->query_next;
+  if (!unix_serial_write(port, port->query.query, port->query.query_len,
+			 port->app)) {
+    port->polling = 0;
+    return;
+  }
+  stats->poll_queries++;
+  if (late > stats->poll_late_max) stats->poll_late_max = late;
+  port->query_sent = now;
+  port->awaiting = 1;
+  port->response_len = 0;
+  /* Keep to the schedule unless a whole period has been missed */
+  port->query_next += port->query.period;
+  if (port->query_next <= now) port->query_next = now + port->query.period;
+}
+
+/* Handle expired timeouts and send a query if one is due */
+static void
+poll_check(struct SerialPort *port, uint64_t now)
+{
+  if (port->awaiting && port->query_sent + port->query.timeout <= now) {
+    poll_timeout(port, now);
+  }
+  if (port->query_next <= now) poll_send_query(port, now);
+}
+
+/* Send what is due for all ports */
+static void
+port_timers_check(struct AppContext *app)
+{
+  struct SerialPort *port;
+  uint64_t now;
+  /* Without credits, polls and device state are still sent */
+  if (input_blocked(app) && app->output_blocked) return;
+  now = now_us();
+  for (port = app->serial_ports; port; port = port->next) {
+    if (port_deadline(port) > now) continue;
+    /* The deadline may be for another timer */
+    if (port->coalesce_len > 0 && !app->credit_blocked
+	&& port->coalesce_start + port->coalesce_delay <= now) {
+      coalesce_flush(port, now);
+    }
+    if (port->codec && port->codec_sent + port->codec_interval <= now) {
+      codec_send_state(port, now);
+    }
+    if (port->polling) poll_check(port, now);
+  }
+}
+
+/* Poll timeout in milliseconds until the first port deadline, or -1
+   if nothing is held back */
+static int
+port_timers_timeout(struct AppContext *app)
+{
+  struct SerialPort *port;
+  uint64_t now;
+  uint64_t next = UINT64_MAX;
+  if (app->output_blocked) return -1;
+  for (port = app->serial_ports; port; port = port->next) {
+    uint64_t deadline = port_deadline(port);
+    if (deadline < next) next = deadline;
+  }
+  if (next == UINT64_MAX) return -1;
+  now = now_us();
+  if (next <= now) return 0;
+  return (next - now + 999) / 1000;
+}
+
+/* True if the pending buffer of the port has room for more data */
+static int
+pending_room(struct SerialPort *port)
+{
+  if (!port->pending) {
+    port->pending = malloc(port->buffer_size);
+    if (!port->pending) return 0;
+  }
+  return port->pending_len < port->buffer_size;
+}
+
+/* Read into the pending buffer of the port. A poll response is sent
+   at once and not kept. Returns the result of read(). */
+static ssize_t
+serial_recv_pending(struct SerialPort *port, int fd)
+{
+  ssize_t r;
+  uint8_t *data = port->pending + port->pending_len;
+  r = read(fd, data, port->buffer_size - port->pending_len);
+  if (r > 0) {
+    unsigned int n = 0;
+    port->app->sp.recv_stats.reads++;
+    if (port->awaiting) n = poll_response_input(port, data, r);
+    memmove(data, data + n, r - n);
+    port->pending_len += r - n;
+  }
+  return r;
+}
+
 static int
 serial_recv(struct pollfd *poll, void *cb_data)
 {
-  uint8_t read_buffer[256];
-  size_t r;
+  ssize_t r;
   struct SerialPort *port = cb_data;
   struct AppContext *app = port->app;
   if (poll->revents & POLLIN) {
-    r = read(poll->fd, read_buffer, sizeof(read_buffer));
+    if (input_blocked(app)) {
+      if (!app->output_blocked && port->codec) {
+	/* Only the device state is sent, which takes no credits */
+	r = serial_recv_frames(port, poll->fd);
+      } else if (((!app->output_blocked && port->polling)
+		  || app->nm.out_policy == NM_OVERFLOW_MERGE)
+		 && pending_room(port)) {
+	r = serial_recv_pending(port, poll->fd);
+      } else {
+	poll->events = 0; /* Wait for output to drain or credits */
+	return 1;
+      }
+    } else if (port->read_buffer) {
+      r = serial_recv_frames(port, poll->fd);
+    } else if (port->coalesce) {
+      r = serial_recv_coalesce(port, poll->fd);
+    } else {
+      r = serial_recv_message(port, poll->fd);
+    }
     if (r < 0) {
-      PRINTERR("Failed to read from %s\n", port->path);
-      native_message_printf(&app->nm,
-			    "[\"serialError\", \"%s\", \"Failed to read from %s\"]",
-			    port->path, port->path);
+      struct JSONEmitter je;
+      char text[100];
+      PRINTERR("Failed to receive from %s: %s\n",
+	       port->path, strerror(errno));
+      snprintf(text, sizeof(text), "Failed to receive from %s: %s",
+	       port->path, strerror(errno));
+      json_emit_init(&je, &app->nm);
+      json_emit_array_begin(&je);
+      json_emit_string(&je, "serialError");
+      json_emit_string(&je, port->path);
+      json_emit_string(&je, text);
+      json_emit_array_end(&je);
       native_message_send(&app->nm);
-    } else if (r > 0) {
-      native_message_append_str(&app->nm,"[\"serialRecv\",\"");
-      native_message_append_str(&app->nm,port->path);
-      native_message_append_str(&app->nm,"\",\"");
-      native_message_append_base64(&app->nm, read_buffer, r);
-      native_message_append_str(&app->nm,"\"]");
-      native_message_send(&app->nm);
-      app->nm.out_buffer[app->nm.out_len-4] = '\0';
-      PRINTDEBUG("Serial recv: %s\n", app->nm.out_buffer+4);
-    } else {
+    } else if (r == 0) {
+      coalesce_flush(port, now_us());
       return 0;
     }
+  } else if (poll->revents & (POLLHUP | POLLERR)) {
+    /* Hung up while input is held back. Reported even though POLLIN
+       isn't polled for, so waiting would spin. */
+    return 0;
   } else if (poll->revents == 0) {
     serial_port_destroy(port);
     return 0;
@@ -152,6 +749,65 @@ serial_recv(struct pollfd *poll, void *cb_data)
   return 1;
 }
 
+/* Send the data held back for all ports and read them again */
+static void
+release_input(struct AppContext *app)
+{
+  struct SerialPort *port;
+  for (port = app->serial_ports; port; port = port->next) {
+    /* Held back data is older than the pending data */
+    coalesce_flush(port, now_us());
+    if (port->pending_len > 0) {
+      /* Poll responses have already been taken out */
+      int awaiting = port->awaiting;
+      port->awaiting = 0;
+      deliver_serial_data(port, port->pending, port->pending_len);
+      port->awaiting = awaiting;
+      port->pending_len = 0;
+    }
+    if (port->poll) port->poll->events = POLLIN;
+  }
+}
+
+/* Block or unblock serial input depending on how full the output
+   queue is and the credits left. Called after each flush. */
+static void
+update_output_state(struct AppContext *app)
+{
+  struct NativeMessage *nm = &app->nm;
+  if (app->output_blocked) {
+    if (native_message_output_low(nm)) {
+      app->output_blocked = 0;
+      if (!input_blocked(app)) {
+	release_input(app);
+      } else {
+	struct SerialPort *port;
+	/* Only serialRecv data is held back for credits */
+	for (port = app->serial_ports; port; port = port->next) {
+	  if (port->poll && (port->codec || port->polling)) {
+	    port->poll->events = POLLIN;
+	  }
+	}
+      }
+    }
+  } else if (nm->out_policy != NM_OVERFLOW_DROP
+	     && native_message_output_full(nm)) {
+    PRINTDEBUG("Output queue full, holding back serial input\n");
+    app->output_blocked = 1;
+  } else if (app->credit_blocked) {
+    if (scratch_protocol_credit_available(&app->sp)) {
+      app->credit_blocked = 0;
+      release_input(app);
+    }
+  } else {
+    input_blocked(app);
+  }
+  /* After delivering held back data, so that it is written too */
+  if (app->stdout_poll) {
+    app->stdout_poll->events = native_message_output_pending(nm) ? POLLOUT : 0;
+  }
+}
+
 void
 print_req(const uint8_t *msg, unsigned int len, void *context)
 {
@@ -165,6 +821,109 @@ unix_serial_get_ports(void *context)
   return (const char**)app->config_data->serial_ports;
 }
 
+/* Opening a port may block, waiting for carrier or for the driver.
+   This runs in a helper thread so that other ports and requests are
+   handled meanwhile. */
+static void *
+open_thread(void *data)
+{
+  struct OpenJob *job = data;
+  job->fd = serial_open(job->path, &job->opts);
+  if (write(job->done_fd, &job, sizeof(job)) != sizeof(job)) {
+    PRINTERR("Failed to signal completion of serial open\n");
+  }
+  return NULL;
+}
+
+/* Start polling a newly opened port. Returns 0 on failure, in which
+   case fd is closed. */
+static int
+serial_port_start(struct SerialPort *port, int fd)
+{
+  port->poll = add_fd(port->app, fd, POLLIN, serial_recv, port);
+  if (!port->poll) {
+    PRINTERR("No more files allowed\n");
+    close(fd);
+    return 0;
+  }
+  if (port->app->output_blocked) port->poll->events = 0;
+  return 1;
+}
+
+/* Called when the helper thread of a job has finished */
+static void
+finish_open(struct AppContext *app, struct OpenJob *job)
+{
+  struct SerialPort *port = job->port;
+  int ok = 0;
+  pthread_join(job->thread, NULL);
+  port->opening = 0;
+  if (job->fd >= 0) {
+    if (port->closing) {
+      close(job->fd);
+    } else {
+      ok = serial_port_start(port, job->fd);
+    }
+  }
+  if (!ok) serial_port_destroy(port);
+  scratch_protocol_complete(&app->sp, &job->reply, ok);
+  free(job->path);
+  free(job);
+}
+
+static int
+handle_open_done(struct pollfd *poll, void *cb_data)
+{
+  struct AppContext *app = cb_data;
+  struct OpenJob *job;
+  if (poll->revents == 0) return 0;
+  while(read(poll->fd, &job, sizeof(job)) == sizeof(job)) {
+    finish_open(app, job);
+  }
+  return 1;
+}
+
+/* Start opening a port in a helper thread. Returns 0 if no thread
+   could be started. */
+static int
+start_open_job(struct SerialPort *port, const char *path,
+	       struct SerialOpts *opts)
+{
+  struct AppContext *app = port->app;
+  struct OpenJob *job = malloc(sizeof(struct OpenJob));
+  sigset_t block;
+  sigset_t old;
+  int err;
+  if (!job) return 0;
+  job->port = port;
+  job->path = strdup(path);
+  if (!job->path) {
+    free(job);
+    return 0;
+  }
+  job->opts = *opts;
+  job->done_fd = app->open_done[1];
+  job->fd = -1;
+  /* The thread inherits the signal mask. Signals must go to the main
+     thread, where they interrupt poll(). */
+  sigemptyset(&block);
+  sigaddset(&block, SIGINT);
+  sigaddset(&block, SIGHUP);
+  pthread_sigmask(SIG_BLOCK, &block, &old);
+  err = pthread_create(&job->thread, NULL, open_thread, job);
+  pthread_sigmask(SIG_SETMASK, &old, NULL);
+  if (err != 0) {
+    PRINTERR("Failed to start thread for opening port\n");
+    free(job->path);
+    free(job);
+    return 0;
+  }
+  /* The job isn't finished until the completion pipe is read */
+  scratch_protocol_defer_reply(&app->sp, &job->reply);
+  port->opening = 1;
+  return 1;
+}
+
 static int 
 unix_serial_open(const char *path, struct SerialOpts *opts,
 		 void *context)
@@ -178,31 +937,81 @@ unix_serial_open(const char *path, struct SerialOpts *opts,
     PRINTERR("Serial path already open\n");
     return 0;
   }
-  fd = serial_open(path, opts);
-  if (fd < 0) {
-    return 0;
-  }
   port = malloc(sizeof(struct SerialPort));
-  port->app = app;
-  
   if (!port) {
     PRINTERR("No memory for serial port\n");
     return 0;
   }
+  port->app = app;
+  port->buffer_size = opts->bufferSize > 0 ? opts->bufferSize : 4096;
+  port->pending = NULL;
+  port->pending_len = 0;
+  port->coalesce = NULL;
+  port->coalesce_len = 0;
+  port->coalesce_delay = (opts->coalesceDelay > 0
+			 ? opts->coalesceDelay : SERIAL_COALESCE_DELAY_DEFAULT);
+  port->read_buffer = NULL;
+  port->poll_buffer = 0;
+  port->codec = NULL;
+  port->codec_interval = opts->codecInterval;
+  port->codec_sent = 0;
+  port->last_frame = NULL;
+  port->last_frame_len = UINT_MAX; /* Matches no frame */
+  port->heartbeat = opts->heartbeat;
+  port->polling = 0;
+  port->awaiting = 0;
+  port->response = NULL;
+  port->poll = NULL;
+  port->opening = 0;
+  port->closing = 0;
   
-  port->poll = add_fd(app, fd, POLLIN, serial_recv, port);
-  if (!port->poll) {
-    PRINTERR("No more files allowed\n");
-    free(port);
+  port->path = strdup(path);
+  port->recv_prefix = malloc(sizeof(RECV_PREFIX_START) - 1
+			     + JSON_ESCAPED_MAX(strlen(path)) + 3);
+  if (!serial_framer_init(&port->framer, opts)) {
+    serial_port_free(port);
     return 0;
   }
-  port->path = strdup(path);
-  if (!port->path) {
+  if (!port->path || !port->recv_prefix) {
     PRINTERR("No memory for path\n");
-    free(port);
+    serial_port_free(port);
     return 0;
   }
-  
+  port->recv_prefix_len = build_recv_prefix(port->recv_prefix, path);
+  if (opts->codec) {
+    port->codec = opts->codec->create();
+    if (!port->codec) {
+      PRINTERR("No memory for %s codec\n", opts->codec->name);
+      serial_port_free(port);
+      return 0;
+    }
+  }
+  if (opts->dedup && !opts->codec) {
+    port->last_frame = malloc(port->framer.max_frame);
+    if (!port->last_frame) {
+      PRINTERR("No memory for last frame\n");
+      serial_port_free(port);
+      return 0;
+    }
+  }
+  if (opts->codec || opts->framing != SERIAL_FRAMING_NONE) {
+    port->read_buffer = malloc(port->buffer_size);
+    if (!port->read_buffer) {
+      PRINTERR("No memory for read buffer\n");
+      serial_port_free(port);
+      return 0;
+    }
+  } else if (opts->coalesceDelay > 0 || opts->coalesceBytes > 0) {
+    port->coalesce_size = (opts->coalesceBytes > 0
+			   ? opts->coalesceBytes : port->buffer_size);
+    port->coalesce = malloc(port->coalesce_size);
+    if (!port->coalesce) {
+      PRINTERR("No memory for coalescing buffer\n");
+      serial_port_free(port);
+      return 0;
+    }
+  }
+
   /* Link port */
   port->prevp = &app->serial_ports;
   port->next = app->serial_ports;
@@ -210,6 +1019,14 @@ unix_serial_open(const char *path, struct SerialOpts *opts,
     port->next->prevp = &port->next;
   }
   app->serial_ports = port;
+
+  if (start_open_job(port, path, opts)) return 1; /* Replied to later */
+
+  fd = serial_open(path, opts);
+  if (fd < 0 || !serial_port_start(port, fd)) {
+    serial_port_destroy(port);
+    return 0;
+  }
   return 1;
 }
 
@@ -223,43 +1040,50 @@ unix_serial_close(const char *path, void *context)
     PRINTERR("Trying to close unopened path: %s\n", path);
     return 0;
   }
+  if (port->opening) {
+    /* Freed when the open has finished. Unlinked now, so that the path
+       can be opened again before that. */
+    port->closing = 1;
+    serial_port_unlink(port);
+    return 1;
+  }
+  /* Data held back by coalescing is dropped, like unread data. The
+     reply is being built so nothing else can be sent here. */
   serial_port_destroy(port);
   return 1;
 }
   
-static int 
-unix_serial_write(const char *path, const uint8_t *data, unsigned int len,
-		  void *context)
+static void *
+unix_serial_find(const char *path, void *context)
 {
-  struct SerialPort *port;
   struct AppContext *app = context;
-  port = find_serial_port_by_path(app->serial_ports, path);
-  if (!port) {
-    PRINTERR("Trying to send to unopened path: %s\n", path);
-    return 0;
-  }
-  while(len > 0) {
-    ssize_t written = write(port->poll->fd, data, len);
-    if (written < 0) {
-      PRINTERR("Failed to write to serial port: %s\n", strerror(errno));
-      return 0;
-    }
-    data += written;
-    len -= written;
-  }
-  return 1;
+  struct SerialPort *port = find_serial_port_by_path(app->serial_ports, path);
+  return port && !port->opening ? port : NULL;
+}
+
+static unsigned int
+unix_serial_write_size(void *handle, void *context)
+{
+  struct SerialPort *port = handle;
+  return port->buffer_size;
 }
 
 static int
 handle_stdin(struct pollfd *poll, void *cb_data)
 {
   uint8_t *buffer;
-  int r;
+  unsigned int room;
+  ssize_t r;
   struct AppContext *app = cb_data;
   if (poll->revents == 0) return 0;
-  r = native_message_get_input_buffer(&app->nm, &buffer);
-  r = read(poll->fd, buffer, r);
+  room = native_message_get_input_buffer(&app->nm, &buffer);
+  if (room == 0) {
+    PRINTERR("No room for input\n");
+    return 0;
+  }
+  r = read(poll->fd, buffer, room);
   if (r == 0) return 0; /* EOF */
+  if (r < 0 && (errno == EAGAIN || errno == EINTR)) return 1;
   if (r < 0) {
     PRINTERR("Failed to read stdin: %s\n", strerror(errno));
     return 0;
@@ -268,10 +1092,43 @@ handle_stdin(struct pollfd *poll, void *cb_data)
   return 1;
 }
 
-static void 
-write_stdout(const uint8_t *data, unsigned int len, void *context)
+#define MAX_WRITE_IOV 256
+
+static long
+write_stdout(const struct NativeMessageFrame *frames, unsigned int offset,
+	     void *context)
 {
-  write(STDOUT_FILENO, data, len);
+  struct iovec iov[MAX_WRITE_IOV];
+  int n = 0;
+  ssize_t w;
+  while(frames && n < MAX_WRITE_IOV) {
+    iov[n].iov_base = frames->data + offset;
+    iov[n].iov_len = frames->len - offset;
+    offset = 0;
+    frames = frames->next;
+    n++;
+  }
+  do {
+    w = writev(STDOUT_FILENO, iov, n);
+  } while(w < 0 && errno == EINTR);
+  if (w < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return 0;
+  if (w < 0) {
+    PRINTERR("Failed to write to stdout: %s\n", strerror(errno));
+    return -1;
+  }
+  return w;
+}
+
+static int
+handle_stdout(struct pollfd *poll, void *cb_data)
+{
+  struct AppContext *app = cb_data;
+  if (poll->revents == 0) {
+    app->stdout_poll = NULL;
+    return 0;
+  }
+  if (poll->revents & (POLLERR | POLLHUP | POLLNVAL)) return 0;
+  return native_message_flush(&app->nm);
 }
 
 static void 
@@ -281,6 +1138,20 @@ message_handler(const uint8_t *msg, unsigned int len, void *context)
   scratch_protocol_message_handler(&app->sp, msg, len);
 }
 
+static int
+stream_begin(const uint8_t *start, unsigned int start_len, void *context)
+{
+  struct AppContext *app = context;
+  return scratch_protocol_stream_begin(&app->sp, start, start_len);
+}
+
+static void
+stream_data(const uint8_t *data, unsigned int len, int last, void *context)
+{
+  struct AppContext *app = context;
+  scratch_protocol_stream_data(&app->sp, data, len, last);
+}
+
 static int exit_pending = 0;
 
 static void
@@ -293,15 +1164,71 @@ handle_sig(int s)
 static const struct NativeMessageCallbacks nm_callbacks =
   {
     message_handler,
-    write_stdout
+    write_stdout,
+    stream_begin,
+    stream_data
   };
 
+static int
+unix_serial_poll_start(void *handle, const struct ScratchPoll *poll,
+		       void *context)
+{
+  struct SerialPort *port = handle;
+  if (poll->length > port->buffer_size) {
+    PRINTERR("Poll response longer than the buffer size\n");
+    return 0;
+  }
+  /* Received data must pass deliver_serial_data */
+  if (!port->read_buffer) {
+    port->read_buffer = malloc(port->buffer_size);
+    if (!port->read_buffer) {
+      PRINTERR("No memory for read buffer\n");
+      return 0;
+    }
+    port->poll_buffer = 1;
+  }
+  if (!port->response) {
+    port->response = malloc(port->buffer_size);
+    if (!port->response) {
+      PRINTERR("No memory for poll response\n");
+      return 0;
+    }
+  }
+  port->query = *poll;
+  port->polling = 1;
+  /* Responses are read even without credits */
+  if (port->poll && !port->app->output_blocked) port->poll->events = POLLIN;
+  port->awaiting = 0;
+  port->query_next = now_us(); /* Sent by the next timer check */
+  return 1;
+}
+
+static int
+unix_serial_poll_stop(void *handle, void *context)
+{
+  struct SerialPort *port = handle;
+  if (!port->polling) return 0;
+  port->polling = 0;
+  port->awaiting = 0;
+  if (port->poll_buffer) {
+    /* Go back to reading the way the port was opened */
+    free(port->read_buffer);
+    port->read_buffer = NULL;
+    port->poll_buffer = 0;
+  }
+  return 1;
+}
+
 static const struct ScratchSerialCallbacks serial_callbacks =
   {
     unix_serial_get_ports,
     unix_serial_open,
     unix_serial_close,
-    unix_serial_write
+    unix_serial_find,
+    unix_serial_write_size,
+    unix_serial_write,
+    unix_serial_poll_start,
+    unix_serial_poll_stop
   };
     
 
@@ -314,6 +1241,10 @@ main(int argc, char *argv[])
   PRINTDEBUG("Device host started\n");
   app.serial_ports = NULL;
   app.config_data = NULL;
+  app.stdout_poll = NULL;
+  app.output_blocked = 0;
+  app.credit_blocked = 0;
+  app.start_time = now_us();
 
   snprintf(conf_filename, sizeof(conf_filename), "%s.json", argv[0]);
   app.config_data = config_data_read(conf_filename);
@@ -323,10 +1254,29 @@ main(int argc, char *argv[])
   }
 
   native_message_init(&app.nm, &nm_callbacks, &app);
+  if (app.config_data->max_message_size > 0) {
+    native_message_set_input_limit(&app.nm, app.config_data->max_message_size);
+  }
+  native_message_set_output_limit(&app.nm,
+				  app.config_data->output_queue_limit,
+				  app.config_data->overflow_policy);
   scratch_protocol_init(&app.sp, &app.nm, &serial_callbacks, &app);
+  scratch_protocol_set_credit_limits(&app.sp,
+				     app.config_data->credit_max_messages,
+				     app.config_data->credit_max_bytes);
   app.n_poll = 0;
   
   add_fd(&app, STDIN_FILENO, POLLIN, handle_stdin, &app);
+  /* Only polled for POLLOUT while there is queued output */
+  fcntl(STDOUT_FILENO, F_SETFL, fcntl(STDOUT_FILENO, F_GETFL) | O_NONBLOCK);
+  app.stdout_poll = add_fd(&app, STDOUT_FILENO, 0, handle_stdout, &app);
+  if (pipe(app.open_done) < 0) {
+    PRINTERR("Failed to create pipe: %s\n", strerror(errno));
+    app_cleanup(&app);
+    return EXIT_FAILURE;
+  }
+  fcntl(app.open_done[0], F_SETFL, O_NONBLOCK);
+  add_fd(&app, app.open_done[0], POLLIN, handle_open_done, &app);
   
   sig_handler.sa_handler = handle_sig;
   sigemptyset(&sig_handler.sa_mask);
@@ -334,10 +1284,12 @@ main(int argc, char *argv[])
 
   sigaction(SIGINT,&sig_handler, NULL);
   sigaction(SIGHUP,&sig_handler, NULL);
+  /* A closed stdout is detected by write errors instead */
+  signal(SIGPIPE, SIG_IGN);
 
   /* Run until stdin is closed */
   while(app.n_poll > 0 && app.pollfds[0].fd >= 0) {
-    int n = poll(app.pollfds, app.n_poll, -1);
+    int n = poll(app.pollfds, app.n_poll, port_timers_timeout(&app));
     if (n < 0) {
       if (errno == EINTR && exit_pending) break;
       PRINTERR("poll failed: %s", strerror(errno));
@@ -359,8 +1311,13 @@ main(int argc, char *argv[])
 	}
       }
     }
+    port_timers_check(&app);
+    /* Write all replies and received data in one go */
+    if (!native_message_flush(&app.nm)) break;
+    update_output_state(&app);
   }
-  PRINTDEBUG("Exiting\n");
+  PRINTDEBUG("Exiting after %lu messages in %lu reads\n",
+	     app.nm.stats.messages_in, app.nm.stats.reads);
   app_cleanup(&app);
   return EXIT_SUCCESS;
 }
@@ -6,6 +6,7 @@
 #include <Windows.h>
 #include <native_message.h>
 #include <scratch_protocol.h>
+#include <json_emit.h>
 #include <debug.h>
 #include <string.h>
 #include <assert.h>
@@ -48,6 +49,7 @@ struct SerialPort
   char *path;
   HANDLE thread;
   HANDLE events[3];
+  unsigned int write_size; /* From SerialOpts */
 };
 
 
@@ -225,8 +227,9 @@ win_serial_get_ports(void *context)
   return (const char**)app->ports;
 }
 
-static void 
-write_stdout(const uint8_t *data, unsigned int len, void *context);
+static long
+write_stdout(const struct NativeMessageFrame *frames, unsigned int offset,
+	     void *context);
 
 DWORD WINAPI 
 handle_read(LPVOID lpParam ) 
@@ -259,12 +262,37 @@ handle_read(LPVOID lpParam )
     
     WaitForSingleObject(app->out_mutex, INFINITE);
     
-    native_message_append_str(&app->nm,"[\"serialRecv\",\"");
-    native_message_append_str(&app->nm,serport->path);
-    native_message_append_str(&app->nm,"\",\"");
-    native_message_append_base64(&app->nm, buffer, r);
-    native_message_append_str(&app->nm,"\"]");
-    native_message_send(&app->nm);
+    /* For the stats. Credits aren't enforced here, so serial_credit
+       reports them as not enforced. */
+    app->sp.recv_stats.reads++;
+    if (app->sp.binary) {
+      uint8_t header[SCRATCH_BINARY_RECV_HEADER(255)];
+      unsigned int header_len;
+      uint8_t *out = NULL;
+      /* Nothing is sent if the path is too long or there is no memory */
+      header_len = scratch_protocol_binary_recv_header(header, serport->path);
+      if (header_len > 0) {
+	out = native_message_reserve(&app->nm, header_len + r);
+      }
+      if (out) {
+	memcpy(out, header, header_len);
+	memcpy(out + header_len, buffer, r);
+	native_message_commit(&app->nm, header_len + r);
+	native_message_send_data(&app->nm);
+	scratch_protocol_count_recv(&app->sp, r);
+      }
+    } else {
+      struct JSONEmitter je;
+      json_emit_init(&je, &app->nm);
+      json_emit_array_begin(&je);
+      json_emit_string(&je, "serialRecv");
+      json_emit_string(&je, serport->path);
+      json_emit_base64(&je, buffer, r);
+      json_emit_array_end(&je);
+      native_message_send_data(&app->nm);
+      scratch_protocol_count_recv(&app->sp, r);
+    }
+    native_message_flush(&app->nm);
     
     ReleaseMutex(app->out_mutex);
    
@@ -413,6 +441,7 @@ win_serial_open(const char *port, struct SerialOpts *opts,
 
   serport = serial_port_add(app, port);
   serport->handle = h;
+  serport->write_size = opts->bufferSize > 0 ? opts->bufferSize : 4096;
   ResetEvent(serport->events[EVENT_TERMINATE]);
   thread = CreateThread(NULL, 0, handle_read, serport, 0, NULL);
   if (!thread) {
@@ -435,16 +464,27 @@ win_serial_close(const char *path, void *context)
   return 1;
 }
 
+static void *
+win_serial_find(const char *path, void *context)
+{
+  struct AppContext *app = context;
+  return find_serial_port_by_path(app->serial_ports, path);
+}
+
+static unsigned int
+win_serial_write_size(void *handle, void *context)
+{
+  struct SerialPort *serport = handle;
+  return serport->write_size;
+}
+
 static int
-win_serial_write(const char *path, const uint8_t *data, unsigned int len, 
-		      void *context)
+win_serial_write(void *handle, const uint8_t *data, unsigned int len, 
+		 void *context)
 {
   OVERLAPPED async;
   DWORD written;
-  struct AppContext *app = context;
-  struct SerialPort *serport;
-  serport = find_serial_port_by_path(app->serial_ports, path);
-  if (!serport) return 0;
+  struct SerialPort *serport = handle;
   async.hEvent = serport->events[EVENT_WRITE];
   if (!WriteFile(serport->handle, data, len, &written, &async)) {
     if (GetLastError() != ERROR_IO_PENDING) {
@@ -473,6 +513,8 @@ static const struct ScratchSerialCallbacks serial_callbacks =
     win_serial_get_ports,
     win_serial_open,
     win_serial_close,
+    win_serial_find,
+    win_serial_write_size,
     win_serial_write
   };
 
@@ -483,43 +525,70 @@ message_handler(const uint8_t *msg, unsigned int len, void *context)
   scratch_protocol_message_handler(&app->sp, msg, len);
 }
 
-static void 
-write_stdout(const uint8_t *data, unsigned int len, void *context)
+static int
+stream_begin(const uint8_t *start, unsigned int start_len, void *context)
+{
+  struct AppContext *app = context;
+  return scratch_protocol_stream_begin(&app->sp, start, start_len);
+}
+
+static void
+stream_data(const uint8_t *data, unsigned int len, int last, void *context)
+{
+  struct AppContext *app = context;
+  scratch_protocol_stream_data(&app->sp, data, len, last);
+}
+
+static long
+write_stdout(const struct NativeMessageFrame *frames, unsigned int offset,
+	     void *context)
 {
   DWORD written;
+  long total = 0;
   struct AppContext *app = context;
+  while(frames) {
+    const uint8_t *data = frames->data + offset;
+    unsigned int len = frames->len - offset;
 #if 0
-  {
-    int i;
-    PRINTDEBUG("Writing to stdout %d %p %p\n", len, app->out, data);
-    for (i = 0; i < len; i++) {
-      PRINTDEBUG(" %02x", data[i]);
+    {
+      int i;
+      PRINTDEBUG("Writing to stdout %d %p %p\n", len, app->out, data);
+      for (i = 0; i < len; i++) {
+	PRINTDEBUG(" %02x", data[i]);
+      }
+      PRINTDEBUG("\n");
     }
-    PRINTDEBUG("\n");
-  }
 #endif
 #if 1
-  {
-    int i;
-    PRINTDEBUG("stdout %d '",
-	       data[0] | (data[1] << 8) | (data[2]<<16) | (data[3]<<24));
-    for (i = 4; i < len; i++) {
-      PRINTDEBUG("%c", data[i]);
+    if (offset == 0) {
+      int i;
+      PRINTDEBUG("stdout %d '",
+		 data[0] | (data[1] << 8) | (data[2]<<16) | (data[3]<<24));
+      for (i = 4; i < len; i++) {
+	PRINTDEBUG("%c", data[i]);
+      }
+      PRINTDEBUG("'\n");
     }
-    PRINTDEBUG("'\n");
-  }
 #endif
-  if (!WriteFile(app->out, data, len, &written, NULL)) {
-    print_sys_error("Failed to write to stdout");
+    if (!WriteFile(app->out, data, len, &written, NULL)) {
+      print_sys_error("Failed to write to stdout");
+      return -1;
+    }
+    total += written;
+    if (written < len) break;
+    offset = 0;
+    frames = frames->next;
   }
-
   /* PRINTDEBUG("Writing to stdout done\n"); */
+  return total;
 }
 
 static const struct NativeMessageCallbacks nm_callbacks =
   {
     message_handler,
-    write_stdout
+    write_stdout,
+    stream_begin,
+    stream_data
   };
 
 
@@ -546,6 +615,11 @@ main()
     uint8_t *buffer;
     DWORD r;
     r = native_message_get_input_buffer(&app.nm, &buffer);
+    if (r == 0) {
+      PRINTERR("No room for input\n");
+      app_cleanup(&app);
+      return EXIT_FAILURE;
+    }
     if (!PeekNamedPipe(in, NULL, 0, NULL, &avail, NULL)) {
       if (GetLastError() == ERROR_BROKEN_PIPE) break;
       print_sys_error("Failed to get available input. "
@@ -568,6 +642,7 @@ main()
       /* PRINTDEBUG("Foo: '%s'\n", buffer+4); */
       WaitForSingleObject(app.out_mutex, INFINITE);
       native_message_input(&app.nm, r);
+      native_message_flush(&app.nm);
       ReleaseMutex(app.out_mutex);
       fflush(stderr);
       continue;
@@ -1,38 +1,158 @@
 #include "native_message.h"
 #include <debug.h>
+#include <base64.h>
+#include <json_parse.h>
 #include <assert.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdarg.h>
 
+const unsigned int native_message_pool_sizes[NM_POOL_CLASSES] =
+  {1024, 4096, 16*1024, 64*1024, 256*1024, NM_OUTPUT_MAX_PAYLOAD + 4};
+
+/* Number of free frames kept for each size class */
+static const unsigned int pool_max_free[NM_POOL_CLASSES] =
+  {256, 64, 16, 4, 2, 1};
+
+static struct NativeMessageFrame *
+frame_new(unsigned int size_class)
+{
+  struct NativeMessageFrame *frame;
+  unsigned int capacity = native_message_pool_sizes[size_class];
+  frame = malloc(sizeof(struct NativeMessageFrame));
+  if (!frame) return NULL;
+  frame->data = malloc(capacity + 1); /* Make room for NUL */
+  if (!frame->data) {
+    free(frame);
+    return NULL;
+  }
+  frame->capacity = capacity;
+  frame->size_class = size_class;
+  frame->len = 0;
+  frame->next = NULL;
+  return frame;
+}
+
+static void
+frame_list_free(struct NativeMessageFrame *frame)
+{
+  while(frame) {
+    struct NativeMessageFrame *next = frame->next;
+    free(frame->data);
+    free(frame);
+    frame = next;
+  }
+}
+
+/* Take a frame of at least the given capacity from the pool or
+   allocate a new one */
+static struct NativeMessageFrame *
+frame_get(struct NativeMessage *nm, unsigned int capacity)
+{
+  struct NativeMessagePool *pool = &nm->pool;
+  struct NativeMessageFrame *frame;
+  unsigned int c = 0;
+  while(native_message_pool_sizes[c] < capacity) {
+    if (++c == NM_POOL_CLASSES) return NULL;
+  }
+  frame = pool->free[c];
+  if (frame) {
+    pool->free[c] = frame->next;
+    pool->n_free[c]--;
+    pool->hits[c]++;
+    frame->next = NULL;
+    return frame;
+  }
+  pool->misses[c]++;
+  return frame_new(c);
+}
+
+/* Return a frame to the pool */
+static void
+frame_release(struct NativeMessage *nm, struct NativeMessageFrame *frame)
+{
+  struct NativeMessagePool *pool = &nm->pool;
+  unsigned int c = frame->size_class;
+  if (pool->n_free[c] >= pool_max_free[c]) {
+    free(frame->data);
+    free(frame);
+    return;
+  }
+  frame->next = pool->free[c];
+  pool->free[c] = frame;
+  pool->n_free[c]++;
+}
+
+static void
+set_out_frame(struct NativeMessage *nm, struct NativeMessageFrame *frame)
+{
+  nm->out_frame = frame;
+  nm->out_buffer = frame->data;
+  nm->out_capacity = frame->capacity;
+}
+
+/* Make room for len more bytes in the current message. The contents
+   are moved to a frame of a larger size class if needed. */
+static int
+ensure_space(struct NativeMessage *nm, unsigned int len)
+{
+  struct NativeMessageFrame *frame;
+  if (len <= nm->out_capacity - nm->out_len) return 1;
+  if (len > NM_OUTPUT_MAX_PAYLOAD + 4 - nm->out_len) {
+    PRINTERR("Message too long\n");
+    return 0;
+  }
+  frame = frame_get(nm, nm->out_len + len);
+  if (!frame) {
+    PRINTERR("No memory for send buffer\n");
+    return 0;
+  }
+  memcpy(frame->data, nm->out_buffer, nm->out_len);
+  frame_release(nm, nm->out_frame);
+  set_out_frame(nm, frame);
+  return 1;
+}
+
 int
 native_message_init(struct NativeMessage *nm, 
 		    const struct NativeMessageCallbacks *callbacks,
 		    void *cb_context)
 {
+  nm->out_frame = NULL;
   nm->out_buffer = NULL;
-  nm->alt_buffer = NULL;
+  nm->out_queue = NULL;
+  nm->out_tail = &nm->out_queue;
+  nm->out_offset = 0;
+  nm->out_queued = 0;
+  nm->out_limit = NM_OUTPUT_DEFAULT_LIMIT;
+  nm->out_policy = NM_OVERFLOW_MERGE;
+  memset(&nm->pool, 0, sizeof(nm->pool));
+  nm->in_start = 0;
   nm->in_len = 0;
-  nm->in_capacity = 1023;
-  nm->in_buffer = malloc(nm->in_capacity + 1); /* Make room for NUL */
+  nm->in_limit = NM_INPUT_DEFAULT_LIMIT;
+  nm->in_capacity = NM_INPUT_INITIAL_CAPACITY;
+  /* Make room for NUL and padding for the parser */
+  nm->in_buffer = malloc(nm->in_capacity + 1 + JSON_PARSE_PADDING);
   if (!nm->in_buffer) {
     PRINTERR("No memory for receive buffer\n");
     return 0;
   }
-  nm->alt_buffer = malloc(nm->in_capacity + 1); /* Make room for NUL */
-  if (!nm->alt_buffer) {
-    PRINTERR("No memory for receive buffer\n");
-    return 0;
-  }
   nm->msg_left = 0;
+  nm->streaming = 0;
+  nm->stream_declined = 0;
+  nm->stats.reads = 0;
+  nm->stats.messages_in = 0;
+  nm->stats.writes = 0;
+  nm->stats.messages_out = 0;
+  nm->stats.messages_dropped = 0;
 
-  nm->out_len = 4;
-  nm->out_capacity = 1023;
-  nm->out_buffer = malloc(nm->out_capacity + 1); /* Make room for NUL */
-  if (!nm->out_buffer) {
+  nm->out_frame = frame_get(nm, 0);
+  if (!nm->out_frame) {
     PRINTERR("No memory for send buffer\n");
     return 0;
   }
+  set_out_frame(nm, nm->out_frame);
+  nm->out_len = 4;
   nm->callbacks = callbacks;
   nm->cb_context = cb_context;
   return 1;
@@ -41,73 +161,153 @@ native_message_init(struct NativeMessage *nm,
 void
 native_message_destroy(struct NativeMessage *nm)
 {
+  unsigned int c;
   free(nm->in_buffer);
-  free(nm->alt_buffer);
-  free(nm->out_buffer);
+  frame_list_free(nm->out_frame);
+  frame_list_free(nm->out_queue);
+  for (c = 0; c < NM_POOL_CLASSES; c++) {
+    frame_list_free(nm->pool.free[c]);
+  }
 }
 
-unsigned int 
-native_message_get_input_buffer(struct NativeMessage *nm, uint8_t **buffer)
+void
+native_message_set_input_limit(struct NativeMessage *nm, unsigned int limit)
 {
-  unsigned int pos = nm->in_len % nm->in_capacity; /* Wrap long messages */
-  *buffer = &nm->in_buffer[pos];
-  return nm->in_capacity - pos;
+  if (limit < NM_INPUT_INITIAL_CAPACITY) limit = NM_INPUT_INITIAL_CAPACITY;
+  if (limit > NM_INPUT_MAX_LIMIT) limit = NM_INPUT_MAX_LIMIT;
+  nm->in_limit = limit;
 }
 
-static void
-swap_input_buffers(struct NativeMessage *nm)
+void
+native_message_set_output_limit(struct NativeMessage *nm,
+				unsigned int limit, int policy)
 {
-  uint8_t *tmp = nm->in_buffer;
-  nm->in_buffer = nm->alt_buffer;
-  nm->alt_buffer = tmp;
+  nm->out_limit = limit;
+  nm->out_policy = policy;
+}
+
+static int
+resize_input_buffer(struct NativeMessage *nm, unsigned int capacity)
+{
+  uint8_t *b;
+  if (capacity > NM_INPUT_MAX_LIMIT) return 0;
+  b = realloc(nm->in_buffer, capacity + 1 + JSON_PARSE_PADDING);
+  if (!b) return 0;
+  nm->in_buffer = b;
+  nm->in_capacity = capacity;
+  return 1;
+}
+
+unsigned int 
+native_message_get_input_buffer(struct NativeMessage *nm, uint8_t **buffer)
+{
+  unsigned int avail = nm->in_len - nm->in_start;
+  unsigned int need = 4; /* Size of the message being received */
+  if (avail >= 4 && nm->msg_left == 0) {
+    uint32_t msg_len;
+    memcpy(&msg_len, nm->in_buffer + nm->in_start, 4);
+    /* Oversized messages are discarded by native_message_input. Only
+       the start is needed to decide whether to stream a message. */
+    if (msg_len <= nm->in_limit - 4) {
+      need = msg_len + 4;
+      if (msg_len >= NM_STREAM_THRESHOLD && nm->callbacks->stream_begin
+	  && !nm->stream_declined) {
+	need = NM_STREAM_PREFIX + 4;
+      }
+    }
+  }
+  if (avail == 0) {
+    nm->in_start = 0;
+    nm->in_len = 0;
+    /* Release memory after a burst of large messages */
+    if (nm->in_capacity > NM_INPUT_SHRINK_THRESHOLD) {
+      resize_input_buffer(nm, NM_INPUT_INITIAL_CAPACITY);
+    }
+  } else if (nm->in_start > 0
+	     && (need > nm->in_capacity - nm->in_start
+		 || nm->in_capacity - nm->in_len < NM_INPUT_READ_SIZE)) {
+    /* Move the partial message to the start of the arena */
+    memmove(nm->in_buffer, nm->in_buffer + nm->in_start, avail);
+    nm->in_start = 0;
+    nm->in_len = avail;
+  }
+  if (need > nm->in_capacity) {
+    unsigned int capacity = nm->in_limit;
+    if (nm->in_capacity < nm->in_limit / 2) capacity = nm->in_capacity * 2;
+    if (capacity < need) capacity = need;
+    if (!resize_input_buffer(nm, capacity)) {
+      PRINTERR("No memory for receive buffer\n");
+    }
+  }
+  *buffer = &nm->in_buffer[nm->in_len];
+  return nm->in_capacity - nm->in_len;
 }
 
 void
 native_message_input(struct NativeMessage *nm, unsigned int length)
 {
-  while(length > 0) {
-    if (nm->msg_left == 0) {
-      if (nm->in_len + length < 4) {
-	nm->in_len += length;
-	return;
-      }
-      length -= 4 - nm->in_len;
-      nm->in_len = 4;
-      nm->msg_left = *(uint32_t*)nm->in_buffer;
-    } else {
-      if (length >= nm->msg_left) {
-	nm->in_len += nm->msg_left;
-	length -= nm->msg_left;
-	if (nm->in_len <= nm->in_capacity) {
-	  if (length > 0) {
-	    /* Move rest of buffer to alternate buffer to make room for NULL */
-	    memcpy(nm->alt_buffer, nm->in_buffer+nm->in_len, length);
-	  }
-	  nm->in_buffer[nm->in_len] = '\0';
-	  nm->callbacks->handle_message(nm->in_buffer + 4, nm->in_len - 4,
-					nm->cb_context);
-	  swap_input_buffers(nm);
-	} else {
-	  /* Overflow */
-	  if (length > 0) {
-	    /* Rotate buffer */
-	    unsigned int start = nm->in_len % nm->in_capacity;
-	    assert(nm->in_capacity - start >= length);
-	    /* Copy remaining data to start */
-	    memcpy(nm->alt_buffer, nm->in_buffer + start, length);
-	    swap_input_buffers(nm);
-	  }
+  nm->in_len += length;
+  nm->stats.reads++;
+  while(1) {
+    uint32_t msg_len;
+    uint8_t *msg;
+    uint8_t next;
+    unsigned int avail = nm->in_len - nm->in_start;
+    if (nm->msg_left > 0) {
+      /* Stream or discard the rest of the message. Nothing is kept in
+	 the arena. */
+      if (avail > nm->msg_left) avail = nm->msg_left;
+      if (avail == 0) break;
+      nm->msg_left -= avail;
+      if (nm->streaming) {
+	nm->callbacks->stream_data(nm->in_buffer + nm->in_start, avail,
+				   nm->msg_left == 0, nm->cb_context);
+	if (nm->msg_left == 0) {
+	  nm->streaming = 0;
+	  nm->stats.messages_in++;
 	}
-	nm->msg_left = 0;
-	nm->in_len = 0;
-      } else {
-	nm->in_len += length;
-	nm->msg_left -= length;
-	return;
       }
+      nm->in_start += avail;
+      if (nm->msg_left > 0) break;
+      continue;
+    }
+    if (avail < 4) break;
+    memcpy(&msg_len, nm->in_buffer + nm->in_start, 4);
+    if (msg_len > nm->in_limit - 4) {
+      PRINTERR("Discarding message of %u bytes\n", msg_len);
+      nm->in_start += 4;
+      nm->msg_left = msg_len;
+      continue;
+    }
+    if (msg_len >= NM_STREAM_THRESHOLD && nm->callbacks->stream_begin
+	&& !nm->stream_declined) {
+      if (avail - 4 < NM_STREAM_PREFIX) break;
+      if (nm->callbacks->stream_begin(nm->in_buffer + nm->in_start + 4,
+				      NM_STREAM_PREFIX, nm->cb_context)) {
+	nm->in_start += 4;
+	nm->msg_left = msg_len;
+	nm->streaming = 1;
+	continue;
+      }
+      /* Received whole and handled in place like any other message */
+      nm->stream_declined = 1;
     }
+    if (avail - 4 < msg_len) break;
+    /* NUL terminate in place. This overwrites the first byte of the next
+       message, so it is restored afterwards. */
+    msg = nm->in_buffer + nm->in_start + 4;
+    next = msg[msg_len];
+    msg[msg_len] = '\0';
+    nm->callbacks->handle_message(msg, msg_len, nm->cb_context);
+    nm->stats.messages_in++;
+    msg[msg_len] = next;
+    nm->in_start += msg_len + 4;
+    nm->stream_declined = 0;
+  }
+  if (nm->in_start == nm->in_len) {
+    nm->in_start = 0;
+    nm->in_len = 0;
   }
-    
 }
 
 int
@@ -117,69 +317,140 @@ native_message_printf(struct NativeMessage *nm, const char *format, ...)
   va_list ap;
   va_start(ap, format);
   w = vsnprintf((char*)nm->out_buffer+nm->out_len, 
-		nm->out_capacity - nm->out_len,
+		nm->out_capacity - nm->out_len + 1,
 		format, ap);
-  nm->out_len += w;
-  if (nm->out_len > nm->out_capacity) {
-    nm->out_len = nm->out_capacity;
-  }
   va_end(ap);
+  if (w < 0) return 0;
+  if (w > nm->out_capacity - nm->out_len) {
+    /* Didn't fit. Grow and try again. */
+    if (!ensure_space(nm, w)) return 0;
+    va_start(ap, format);
+    vsnprintf((char*)nm->out_buffer+nm->out_len, w + 1, format, ap);
+    va_end(ap);
+  }
+  nm->out_len += w;
   return w;
 }
 
-void
+int
 native_message_append_str(struct NativeMessage *nm, const char *str)
 {
   size_t l = strlen(str);
-  if (nm->out_len + l >= nm->out_capacity) {
-    l = nm->out_capacity - nm->out_len - 1;
-  }
+  if (!ensure_space(nm, l)) return 0;
   memcpy(nm->out_buffer + nm->out_len,str, l);
   nm->out_len += l;
+  return 1;
+}
+
+uint8_t *
+native_message_reserve(struct NativeMessage *nm, unsigned int len)
+{
+  if (!ensure_space(nm, len)) return NULL;
+  return nm->out_buffer + nm->out_len;
+}
+
+void
+native_message_commit(struct NativeMessage *nm, unsigned int len)
+{
+  assert(len <= nm->out_capacity - nm->out_len);
+  nm->out_len += len;
 }
 
-static const uint8_t
-base64chars[] = 
-  "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
 int
 native_message_append_base64(struct NativeMessage *nm,
 			     const uint8_t *data, unsigned int len)
 {
-  uint32_t bits;
-  unsigned int left = nm->out_capacity - nm->out_len;
-  uint8_t *out = nm->out_buffer + nm->out_len;
-  while(len >= 3) {
-    bits = (data[0] << 16) | (data[1] << 8) | data[2];
-    if (left < 4) return 0;
-    *out++ = base64chars[bits >> 18];
-    *out++ = base64chars[(bits >> 12) & 0x3f];
-    *out++ = base64chars[(bits >> 6) & 0x3f];
-    *out++ = base64chars[bits & 0x3f];
-    data += 3;
-    len -= 3;
-    left -= 4;
-  }
-  if (len > 0 && left < 4) return 0;
-  if (len == 2)  {
-    bits = (data[0] << 8) | data[1];
-    *out++ = base64chars[bits >> 10];
-    *out++ = base64chars[(bits >> 4) & 0x3f];
-    *out++ = base64chars[(bits << 2) & 0x3f];
-    *out++ = '=';
-  } else if (len == 1) {
-    *out++ = base64chars[data[0] >> 2];
-    *out++ = base64chars[(data[0] << 4) & 0x3f];
-    *out++ = '=';
-    *out++ = '=';
-  }
-  nm->out_len = out - nm->out_buffer;
+  if (!ensure_space(nm, BASE64_ENCODED_SIZE(len))) return 0;
+  nm->out_len += base64_encode(nm->out_buffer + nm->out_len, data, len);
   return 1;
 }
 
+static void
+queue_frame(struct NativeMessage *nm, int type)
+{
+  uint32_t len = nm->out_len - 4;
+  struct NativeMessageFrame *frame = nm->out_frame;
+  struct NativeMessageFrame *next = frame_get(nm, 0);
+  if (!next) {
+    PRINTERR("No memory for send buffer, message dropped\n");
+    nm->out_len = 4;
+    return;
+  }
+  memcpy(nm->out_buffer, &len, 4);
+  frame->len = nm->out_len;
+  frame->type = type;
+  *nm->out_tail = frame;
+  nm->out_tail = &frame->next;
+  nm->out_queued += frame->len;
+  set_out_frame(nm, next);
+  nm->out_len = 4;
+}
+
 void
-native_message_send(struct NativeMessage *nm)
+native_message_discard(struct NativeMessage *nm)
 {
-  *(uint32_t*)nm->out_buffer = nm->out_len - 4;
-  nm->callbacks->output_message(nm->out_buffer, nm->out_len, nm->cb_context);
   nm->out_len = 4;
 }
+
+void
+native_message_send(struct NativeMessage *nm)
+{
+  queue_frame(nm, NM_FRAME_CONTROL);
+}
+
+/* Drop the oldest data frames until the queue is within its limit. A
+   partially written frame is never dropped. */
+static void
+drop_data_frames(struct NativeMessage *nm)
+{
+  struct NativeMessageFrame **link = &nm->out_queue;
+  if (nm->out_offset > 0) link = &(*link)->next;
+  while(*link && native_message_output_full(nm)) {
+    struct NativeMessageFrame *frame = *link;
+    if (frame->type == NM_FRAME_DATA) {
+      *link = frame->next;
+      if (nm->out_tail == &frame->next) nm->out_tail = link;
+      nm->out_queued -= frame->len;
+      frame_release(nm, frame);
+      nm->stats.messages_dropped++;
+    } else {
+      link = &frame->next;
+    }
+  }
+}
+
+void
+native_message_send_data(struct NativeMessage *nm)
+{
+  queue_frame(nm, NM_FRAME_DATA);
+  if (nm->out_policy == NM_OVERFLOW_DROP && native_message_output_full(nm)) {
+    drop_data_frames(nm);
+  }
+}
+
+int
+native_message_flush(struct NativeMessage *nm)
+{
+  long written;
+  while(nm->out_queue) {
+    written = nm->callbacks->output_frames(nm->out_queue, nm->out_offset,
+					   nm->cb_context);
+    nm->stats.writes++;
+    if (written < 0) return 0;
+    if (written == 0) return 1; /* Would block */
+    written += nm->out_offset;
+    /* Recycle completely written frames */
+    while(nm->out_queue && written >= nm->out_queue->len) {
+      struct NativeMessageFrame *frame = nm->out_queue;
+      written -= frame->len;
+      nm->out_queued -= frame->len;
+      nm->out_queue = frame->next;
+      frame_release(nm, frame);
+      nm->stats.messages_out++;
+    }
+    nm->out_offset = written;
+  }
+  nm->out_tail = &nm->out_queue;
+  nm->out_offset = 0;
+  return 1;
+}
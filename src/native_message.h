@@ -2,20 +2,103 @@
 #define __NATIVE_MESSAGE_H__JH2TJOKQJ4__
 
 #include <stdint.h>
+#include <limits.h>
+#include <json_parse.h>
+
+/* Initial size of the input arena */
+#define NM_INPUT_INITIAL_CAPACITY (32*1024)
+/* Free space kept at the end of the arena so that a burst of messages
+   can be read with a single call */
+#define NM_INPUT_READ_SIZE (16*1024)
+/* An empty arena larger than this is shrunk back to the initial size */
+#define NM_INPUT_SHRINK_THRESHOLD (64*1024)
+/* Highest input limit. The arena also holds a NUL and the parser
+   padding after the message. */
+#define NM_INPUT_MAX_LIMIT (UINT_MAX - 1 - JSON_PARSE_PADDING)
+/* Default upper limit for the size of an incoming message */
+#define NM_INPUT_DEFAULT_LIMIT (8*1024*1024)
+/* Messages at least this long may be handed over in pieces as they
+   arrive, see the stream_begin callback */
+#define NM_STREAM_THRESHOLD (16*1024)
+/* Bytes of such a message received before stream_begin is called */
+#define NM_STREAM_PREFIX 256
+/* Default number of queued output bytes before the queue is full */
+#define NM_OUTPUT_DEFAULT_LIMIT (1024*1024)
+
+/* Largest message Chrome accepts from a native host */
+#define NM_OUTPUT_MAX_PAYLOAD (1024*1024)
+
+/* Output frame buffers are taken from a pool with this many size
+   classes. See native_message_pool_sizes. */
+#define NM_POOL_CLASSES 6
+
+/* Frame types */
+#define NM_FRAME_CONTROL 0 /* Replies and errors. Never dropped. */
+#define NM_FRAME_DATA 1 /* Received serial data */
+
+/* What to do with received data when the output queue is full */
+#define NM_OVERFLOW_DROP 0 /* Drop the oldest queued data frames */
+#define NM_OVERFLOW_MERGE 1 /* Buffer data per port, send it merged later */
+#define NM_OVERFLOW_PAUSE 2 /* Stop reading the serial ports */
+
+struct NativeMessageStats
+{
+  unsigned long reads; /* Calls to native_message_input */
+  unsigned long messages_in; /* Messages handled */
+  unsigned long writes; /* Calls to output_frames */
+  unsigned long messages_out; /* Messages written */
+  unsigned long messages_dropped; /* Data frames dropped on overflow */
+};
+
+struct NativeMessagePool
+{
+  struct NativeMessageFrame *free[NM_POOL_CLASSES];
+  unsigned int n_free[NM_POOL_CLASSES];
+  unsigned long hits[NM_POOL_CLASSES]; /* Buffer reused */
+  unsigned long misses[NM_POOL_CLASSES]; /* Buffer allocated */
+};
+
+/* Capacity of each size class, including length header */
+extern const unsigned int native_message_pool_sizes[NM_POOL_CLASSES];
+
+/* A complete message waiting to be written, including length header */
+struct NativeMessageFrame
+{
+  struct NativeMessageFrame *next;
+  uint8_t *data;
+  unsigned int len;
+  unsigned int capacity;
+  unsigned int size_class;
+  int type; /* NM_FRAME_CONTROL or NM_FRAME_DATA */
+};
 
 struct NativeMessage
 {
-  uint8_t *in_buffer; /* Current input buffer */
-  uint8_t *alt_buffer; /* Alternate input buffer. Used for NUL termination 
-			and unwrapping buffers. */
-  unsigned int in_capacity;
-  unsigned int in_len; /* Bytes received so far */
-  unsigned int msg_left; /* Bytes left until messages ends or 0 if unknown */
+  uint8_t *in_buffer; /* Input arena. Messages are parsed in place. */
+  unsigned int in_capacity; /* Not counting the extra byte for NUL */
+  unsigned int in_limit; /* Maximum message size, including header */
+  unsigned int in_start; /* Start of first unhandled message */
+  unsigned int in_len; /* End of received data */
+  unsigned int msg_left; /* Bytes left of a discarded or streamed message */
+  int streaming; /* The message in progress goes to stream_data */
+  int stream_declined; /* The next message is received whole */
   
+  /* Message currently being built. The buffer belongs to out_frame. */
+  struct NativeMessageFrame *out_frame;
   uint8_t *out_buffer;
   unsigned int out_capacity;
   unsigned int out_len;
+
+  struct NativeMessageFrame *out_queue; /* Sent but not yet written */
+  struct NativeMessageFrame **out_tail; /* Link at end of out_queue */
+  unsigned int out_offset; /* Bytes of the first queued frame written */
+  unsigned int out_queued; /* Total length of queued frames */
+  unsigned int out_limit; /* Queue is full when out_queued reaches this */
+  int out_policy; /* One of NM_OVERFLOW_* */
+  struct NativeMessagePool pool; /* Frames available for reuse */
   
+  struct NativeMessageStats stats;
+
   const struct NativeMessageCallbacks *callbacks;
   void *cb_context;
 };
@@ -23,7 +106,22 @@ struct NativeMessage
 struct NativeMessageCallbacks
 {
   void (*handle_message)(const uint8_t *msg, unsigned int len, void *context);
-  void (*output_message)(const uint8_t *data, unsigned int len, void *context);
+  /* Write the queued frames, starting offset bytes into the first
+     one. Returns the number of bytes written, 0 if the output would
+     block or -1 on error. */
+  long (*output_frames)(const struct NativeMessageFrame *frames,
+			unsigned int offset, void *context);
+  /* Optional. Called when the first NM_STREAM_PREFIX bytes of a
+     message of at least NM_STREAM_THRESHOLD bytes have arrived.
+     Returns non-zero if the message, from its start, should be passed
+     to stream_data as it arrives instead of being buffered for
+     handle_message. */
+  int (*stream_begin)(const uint8_t *start, unsigned int start_len,
+		      void *context);
+  /* The next part of a streamed message. last is set for the final
+     part. The data is only valid during the call. */
+  void (*stream_data)(const uint8_t *data, unsigned int len, int last,
+		      void *context);
 };
 
 int
@@ -34,25 +132,72 @@ void
 native_message_destroy(struct NativeMessage *nm);
 
 
-/* Get a buffer for writing input. Returns capacity */
+/* Set the largest message accepted. Larger messages are discarded.
+   Limited to NM_INPUT_MAX_LIMIT. */
+void
+native_message_set_input_limit(struct NativeMessage *nm, unsigned int limit);
+
+/* Get a buffer for writing input. Returns capacity. The buffer is
+   grown to fit the message currently being received. Returns 0 if it
+   is full and can't be grown. */
 unsigned int 
 native_message_get_input_buffer(struct NativeMessage *nm, uint8_t **buffer);
 		     
-/* Handle input data written to input buffer */
+/* Handle input data written to input buffer. All complete messages
+   are dispatched before returning. */
 void
 native_message_input(struct NativeMessage *nm, 
 		     unsigned int length);
 
-/* Send a message */
+/* Set the output queue limit and what to do when it is reached */
+void
+native_message_set_output_limit(struct NativeMessage *nm,
+				unsigned int limit, int policy);
+
+/* Drop what has been appended to the current message */
+void
+native_message_discard(struct NativeMessage *nm);
+
+/* Queue the current message for output */
 void
 native_message_send(struct NativeMessage *nm);
 
+/* Queue the current message as a data frame. With NM_OVERFLOW_DROP the
+   oldest data frames are dropped to keep the queue within its limit. */
+void
+native_message_send_data(struct NativeMessage *nm);
+
+/* Write queued messages until done or the output would block. Returns
+   0 on error. Called once per event loop iteration, or directly for
+   replies that should not wait. */
+int
+native_message_flush(struct NativeMessage *nm);
+
+/* True if the output queue has reached its limit */
+#define native_message_output_full(nm) ((nm)->out_queued >= (nm)->out_limit)
+/* True if the output queue has drained enough to accept data again */
+#define native_message_output_low(nm) ((nm)->out_queued <= (nm)->out_limit / 2)
+/* True if there are messages left to write */
+#define native_message_output_pending(nm) ((nm)->out_queue != NULL)
+
+/* The append functions grow the current message as needed. They fail
+   if the message would exceed NM_OUTPUT_MAX_PAYLOAD. */
 int
 native_message_printf(struct NativeMessage *nm, const char *format, ...);
 
-void
+int
 native_message_append_str(struct NativeMessage *nm, const char *str);
 
+/* Reserve space for len bytes at the end of the current message and
+   return a pointer to it, or NULL if the message would be too long. The
+   message isn't extended until native_message_commit is called. */
+uint8_t *
+native_message_reserve(struct NativeMessage *nm, unsigned int len);
+
+void
+native_message_commit(struct NativeMessage *nm, unsigned int len);
+
+/* Append data encoded as base64 */
 int
 native_message_append_base64(struct NativeMessage *nm,
 			     const uint8_t *data, unsigned int len);
@@ -0,0 +1,343 @@
+/* Generated by gen_protocol_keys.py from protocol_keys.def. Do not edit. */
+#include "protocol_keys.h"
+#include <string.h>
+#include <debug.h>
+
+static uint32_t
+key_hash(uint32_t seed, const char *key)
+{
+  uint32_t h = 2166136261u ^ seed;
+  while(*key) {
+    h ^= (uint8_t)*key++;
+    h *= 16777619u;
+  }
+  return h;
+}
+
+const char *const scratch_command_names[] =
+  {
+    "version",
+    "serial_list",
+    "serial_open_raw",
+    "serial_close",
+    "serial_send_raw",
+    "stats",
+    "capabilities",
+    "serial_send_batch",
+    "serial_poll_start",
+    "serial_poll_stop",
+    "serial_credit",
+    NULL
+  };
+
+static const signed char scratch_command_slots[32] =
+  {
+    -1, -1, -1, -1, -1, -1, 6, -1,
+    -1, -1, -1, 8, 0, -1, -1, -1,
+    2, -1, -1, 5, -1, -1, -1, -1,
+    10, 9, 4, -1, 7, 1, -1, 3,
+  };
+
+int
+scratch_command_lookup(const char *key)
+{
+  int i = scratch_command_slots[key_hash(5u, key) & 31];
+  if (i < 0 || strcmp(key, scratch_command_names[i]) != 0) return -1;
+  return i;
+}
+
+const char *const serial_opt_names[] =
+  {
+    "bitRate",
+    "bufferSize",
+    "ctsFlowControl",
+    "dataBits",
+    "parityBit",
+    "stopBits",
+    "coalesceDelay",
+    "coalesceBytes",
+    "framing",
+    "delimiter",
+    "lengthBytes",
+    "frameLength",
+    "maxFrame",
+    "codec",
+    "codecInterval",
+    "dedup",
+    "heartbeat",
+    NULL
+  };
+
+static const signed char serial_opt_slots[64] =
+  {
+    -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, 15, -1,
+    -1, -1, -1, -1, -1, 10, -1, 0,
+    -1, -1, -1, 2, 8, 14, 4, -1,
+    6, -1, 3, -1, -1, -1, 16, -1,
+    -1, -1, 5, 9, 13, 1, -1, -1,
+    -1, -1, -1, 11, -1, -1, -1, -1,
+    -1, 12, -1, -1, 7, -1, -1, -1,
+  };
+
+int
+serial_opt_lookup(const char *key)
+{
+  int i = serial_opt_slots[key_hash(15u, key) & 63];
+  if (i < 0 || strcmp(key, serial_opt_names[i]) != 0) return -1;
+  return i;
+}
+
+const char *const poll_opt_names[] =
+  {
+    "period",
+    "timeout",
+    "delimiter",
+    "length",
+    NULL
+  };
+
+static const signed char poll_opt_slots[8] =
+  {
+    1, -1, 2, -1, 0, 3, -1, -1,
+  };
+
+int
+poll_opt_lookup(const char *key)
+{
+  int i = poll_opt_slots[key_hash(0u, key) & 7];
+  if (i < 0 || strcmp(key, poll_opt_names[i]) != 0) return -1;
+  return i;
+}
+
+const char *const config_key_names[] =
+  {
+    "serial_ports",
+    "max_message_size",
+    "output_queue_limit",
+    "overflow_policy",
+    "credit_max_messages",
+    "credit_max_bytes",
+    NULL
+  };
+
+static const signed char config_key_slots[16] =
+  {
+    4, -1, -1, -1, -1, -1, 2, 5,
+    3, 1, -1, -1, 0, -1, -1, -1,
+  };
+
+int
+config_key_lookup(const char *key)
+{
+  int i = config_key_slots[key_hash(2u, key) & 15];
+  if (i < 0 || strcmp(key, config_key_names[i]) != 0) return -1;
+  return i;
+}
+
+static int
+parse_serial_open_raw(const struct JSONIndex *idx, int array,
+		      struct ScratchArgsSerialOpenRaw *args)
+{
+  int e;
+  e = json_index_array_get(idx, array, 1);
+  if (e < 0) {
+    PRINTERR("serial_open_raw: missing argument path\n");
+    return 0;
+  }
+  if (!json_index_get_string(idx, e, args->path,
+			     sizeof(args->path))) {
+    PRINTERR("serial_open_raw: path must be a string\n");
+    return 0;
+  }
+  e = json_index_array_get(idx, array, 2);
+  args->opts = -1;
+  if (e >= 0) {
+    if (json_index_type(idx, e) != JSON_OBJECT) {
+      PRINTERR("serial_open_raw: opts must be an object\n");
+      return 0;
+    }
+    args->opts = e;
+  }
+  return 1;
+}
+
+static int
+parse_serial_close(const struct JSONIndex *idx, int array,
+		   struct ScratchArgsSerialClose *args)
+{
+  int e;
+  e = json_index_array_get(idx, array, 1);
+  if (e < 0) {
+    PRINTERR("serial_close: missing argument path\n");
+    return 0;
+  }
+  if (!json_index_get_string(idx, e, args->path,
+			     sizeof(args->path))) {
+    PRINTERR("serial_close: path must be a string\n");
+    return 0;
+  }
+  return 1;
+}
+
+static int
+parse_serial_send_raw(const struct JSONIndex *idx, int array,
+		      struct ScratchArgsSerialSendRaw *args)
+{
+  int e;
+  e = json_index_array_get(idx, array, 1);
+  if (e < 0) {
+    PRINTERR("serial_send_raw: missing argument path\n");
+    return 0;
+  }
+  if (!json_index_get_string(idx, e, args->path,
+			     sizeof(args->path))) {
+    PRINTERR("serial_send_raw: path must be a string\n");
+    return 0;
+  }
+  e = json_index_array_get(idx, array, 2);
+  if (e < 0) {
+    PRINTERR("serial_send_raw: missing argument data\n");
+    return 0;
+  }
+  if (json_index_type(idx, e) != JSON_STRING) {
+    PRINTERR("serial_send_raw: data must be a string\n");
+    return 0;
+  }
+  args->data = e;
+  return 1;
+}
+
+static int
+parse_capabilities(const struct JSONIndex *idx, int array,
+		   struct ScratchArgsCapabilities *args)
+{
+  int e;
+  e = json_index_array_get(idx, array, 1);
+  args->caps = -1;
+  if (e >= 0) {
+    if (json_index_type(idx, e) != JSON_OBJECT) {
+      PRINTERR("capabilities: caps must be an object\n");
+      return 0;
+    }
+    args->caps = e;
+  }
+  return 1;
+}
+
+static int
+parse_serial_send_batch(const struct JSONIndex *idx, int array,
+			struct ScratchArgsSerialSendBatch *args)
+{
+  int e;
+  e = json_index_array_get(idx, array, 1);
+  if (e < 0) {
+    PRINTERR("serial_send_batch: missing argument entries\n");
+    return 0;
+  }
+  if (json_index_type(idx, e) != JSON_ARRAY) {
+    PRINTERR("serial_send_batch: entries must be an array\n");
+    return 0;
+  }
+  args->entries = e;
+  return 1;
+}
+
+static int
+parse_serial_poll_start(const struct JSONIndex *idx, int array,
+			struct ScratchArgsSerialPollStart *args)
+{
+  int e;
+  e = json_index_array_get(idx, array, 1);
+  if (e < 0) {
+    PRINTERR("serial_poll_start: missing argument path\n");
+    return 0;
+  }
+  if (!json_index_get_string(idx, e, args->path,
+			     sizeof(args->path))) {
+    PRINTERR("serial_poll_start: path must be a string\n");
+    return 0;
+  }
+  e = json_index_array_get(idx, array, 2);
+  if (e < 0) {
+    PRINTERR("serial_poll_start: missing argument query\n");
+    return 0;
+  }
+  if (json_index_type(idx, e) != JSON_STRING) {
+    PRINTERR("serial_poll_start: query must be a string\n");
+    return 0;
+  }
+  args->query = e;
+  e = json_index_array_get(idx, array, 3);
+  if (e < 0) {
+    PRINTERR("serial_poll_start: missing argument opts\n");
+    return 0;
+  }
+  if (json_index_type(idx, e) != JSON_OBJECT) {
+    PRINTERR("serial_poll_start: opts must be an object\n");
+    return 0;
+  }
+  args->opts = e;
+  return 1;
+}
+
+static int
+parse_serial_poll_stop(const struct JSONIndex *idx, int array,
+		       struct ScratchArgsSerialPollStop *args)
+{
+  int e;
+  e = json_index_array_get(idx, array, 1);
+  if (e < 0) {
+    PRINTERR("serial_poll_stop: missing argument path\n");
+    return 0;
+  }
+  if (!json_index_get_string(idx, e, args->path,
+			     sizeof(args->path))) {
+    PRINTERR("serial_poll_stop: path must be a string\n");
+    return 0;
+  }
+  return 1;
+}
+
+static int
+parse_serial_credit(const struct JSONIndex *idx, int array,
+		    struct ScratchArgsSerialCredit *args)
+{
+  int e;
+  e = json_index_array_get(idx, array, 1);
+  args->grant = -1;
+  if (e >= 0) {
+    if (json_index_type(idx, e) != JSON_OBJECT) {
+      PRINTERR("serial_credit: grant must be an object\n");
+      return 0;
+    }
+    args->grant = e;
+  }
+  return 1;
+}
+
+int
+scratch_args_parse(int command, const struct JSONIndex *idx, int array,
+		   union ScratchArgs *args)
+{
+  switch(command) {
+  case SCRATCH_CMD_SERIAL_OPEN_RAW:
+    return parse_serial_open_raw(idx, array, &args->serial_open_raw);
+  case SCRATCH_CMD_SERIAL_CLOSE:
+    return parse_serial_close(idx, array, &args->serial_close);
+  case SCRATCH_CMD_SERIAL_SEND_RAW:
+    return parse_serial_send_raw(idx, array, &args->serial_send_raw);
+  case SCRATCH_CMD_CAPABILITIES:
+    return parse_capabilities(idx, array, &args->capabilities);
+  case SCRATCH_CMD_SERIAL_SEND_BATCH:
+    return parse_serial_send_batch(idx, array, &args->serial_send_batch);
+  case SCRATCH_CMD_SERIAL_POLL_START:
+    return parse_serial_poll_start(idx, array, &args->serial_poll_start);
+  case SCRATCH_CMD_SERIAL_POLL_STOP:
+    return parse_serial_poll_stop(idx, array, &args->serial_poll_stop);
+  case SCRATCH_CMD_SERIAL_CREDIT:
+    return parse_serial_credit(idx, array, &args->serial_credit);
+  default:
+    return 1;
+  }
+}
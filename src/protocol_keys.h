@@ -0,0 +1,158 @@
+/* Generated by gen_protocol_keys.py from protocol_keys.def. Do not edit. */
+#ifndef __PROTOCOL_KEYS_H__G5MT2WQX8N__
+#define __PROTOCOL_KEYS_H__G5MT2WQX8N__
+
+#include <json_index.h>
+
+/* Size of path arguments, including the terminating '\0' */
+#define SCRATCH_PATH_MAX 50
+
+enum ScratchCommand
+{
+  SCRATCH_CMD_VERSION,
+  SCRATCH_CMD_SERIAL_LIST,
+  SCRATCH_CMD_SERIAL_OPEN_RAW,
+  SCRATCH_CMD_SERIAL_CLOSE,
+  SCRATCH_CMD_SERIAL_SEND_RAW,
+  SCRATCH_CMD_STATS,
+  SCRATCH_CMD_CAPABILITIES,
+  SCRATCH_CMD_SERIAL_SEND_BATCH,
+  SCRATCH_CMD_SERIAL_POLL_START,
+  SCRATCH_CMD_SERIAL_POLL_STOP,
+  SCRATCH_CMD_SERIAL_CREDIT,
+  SCRATCH_CMD_COUNT
+};
+
+/* Returns one of SCRATCH_CMD_* or -1 if the key is unknown */
+int
+scratch_command_lookup(const char *key);
+
+extern const char *const scratch_command_names[];
+
+enum SerialOptKey
+{
+  SERIAL_OPT_BITRATE,
+  SERIAL_OPT_BUFFERSIZE,
+  SERIAL_OPT_CTSFLOWCONTROL,
+  SERIAL_OPT_DATABITS,
+  SERIAL_OPT_PARITYBIT,
+  SERIAL_OPT_STOPBITS,
+  SERIAL_OPT_COALESCEDELAY,
+  SERIAL_OPT_COALESCEBYTES,
+  SERIAL_OPT_FRAMING,
+  SERIAL_OPT_DELIMITER,
+  SERIAL_OPT_LENGTHBYTES,
+  SERIAL_OPT_FRAMELENGTH,
+  SERIAL_OPT_MAXFRAME,
+  SERIAL_OPT_CODEC,
+  SERIAL_OPT_CODECINTERVAL,
+  SERIAL_OPT_DEDUP,
+  SERIAL_OPT_HEARTBEAT,
+  SERIAL_OPT_COUNT
+};
+
+/* Returns one of SERIAL_OPT_* or -1 if the key is unknown */
+int
+serial_opt_lookup(const char *key);
+
+extern const char *const serial_opt_names[];
+
+enum PollOptKey
+{
+  POLL_OPT_PERIOD,
+  POLL_OPT_TIMEOUT,
+  POLL_OPT_DELIMITER,
+  POLL_OPT_LENGTH,
+  POLL_OPT_COUNT
+};
+
+/* Returns one of POLL_OPT_* or -1 if the key is unknown */
+int
+poll_opt_lookup(const char *key);
+
+extern const char *const poll_opt_names[];
+
+enum ConfigKey
+{
+  CONFIG_SERIAL_PORTS,
+  CONFIG_MAX_MESSAGE_SIZE,
+  CONFIG_OUTPUT_QUEUE_LIMIT,
+  CONFIG_OVERFLOW_POLICY,
+  CONFIG_CREDIT_MAX_MESSAGES,
+  CONFIG_CREDIT_MAX_BYTES,
+  CONFIG_COUNT
+};
+
+/* Returns one of CONFIG_* or -1 if the key is unknown */
+int
+config_key_lookup(const char *key);
+
+extern const char *const config_key_names[];
+
+/* Arguments of each command */
+
+struct ScratchArgsSerialOpenRaw
+{
+  char path[SCRATCH_PATH_MAX];
+  int opts;
+};
+
+struct ScratchArgsSerialClose
+{
+  char path[SCRATCH_PATH_MAX];
+};
+
+struct ScratchArgsSerialSendRaw
+{
+  char path[SCRATCH_PATH_MAX];
+  int data;
+};
+
+struct ScratchArgsCapabilities
+{
+  int caps;
+};
+
+struct ScratchArgsSerialSendBatch
+{
+  int entries;
+};
+
+struct ScratchArgsSerialPollStart
+{
+  char path[SCRATCH_PATH_MAX];
+  int query;
+  int opts;
+};
+
+struct ScratchArgsSerialPollStop
+{
+  char path[SCRATCH_PATH_MAX];
+};
+
+struct ScratchArgsSerialCredit
+{
+  int grant;
+};
+
+union ScratchArgs
+{
+  int none; /* Commands without arguments */
+  struct ScratchArgsSerialOpenRaw serial_open_raw;
+  struct ScratchArgsSerialClose serial_close;
+  struct ScratchArgsSerialSendRaw serial_send_raw;
+  struct ScratchArgsCapabilities capabilities;
+  struct ScratchArgsSerialSendBatch serial_send_batch;
+  struct ScratchArgsSerialPollStart serial_poll_start;
+  struct ScratchArgsSerialPollStop serial_poll_stop;
+  struct ScratchArgsSerialCredit serial_credit;
+};
+
+/* Parse the arguments of a command. array is the index entry of the
+   command array, the arguments start at its second element. Returns
+   0 if an argument is missing or has the wrong type. */
+int
+scratch_args_parse(int command, const struct JSONIndex *idx, int array,
+		   union ScratchArgs *args);
+
+#endif /* __PROTOCOL_KEYS_H__G5MT2WQX8N__ */
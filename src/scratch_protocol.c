@@ -2,30 +2,152 @@
 #include <serial.h>
 #include <native_message.h>
 #include <string.h>
+#include <stdlib.h>
 #include <json_parse.h>
+#include <json_index.h>
+#include <protocol_keys.h>
+#include <json_emit.h>
+#include <base64.h>
+#include <device_codec.h>
 #include <debug.h>
 
 static void 
-version_handler(const uint8_t **pp, struct ScratchProtocol *sp)
+version_handler(struct ScratchProtocol *sp, const union ScratchArgs *args)
 {
-  native_message_append_str(sp->nm,"[\"0.1\"]");
+  json_emit_array_begin(&sp->emit);
+  json_emit_string(&sp->emit, "0.1");
+  json_emit_array_end(&sp->emit);
 }
 
 static void 
-serial_list_handler(const uint8_t **pp, struct ScratchProtocol *sp)
+serial_list_handler(struct ScratchProtocol *sp, const union ScratchArgs *args)
 {
   const char **port = sp->callbacks->serial_get_ports(sp->serial_context);
-  native_message_append_str(sp->nm,"[");
+  json_emit_array_begin(&sp->emit);
   while(*port) {
-    native_message_append_str(sp->nm,"\"");
-    native_message_append_str(sp->nm,*port);
-    native_message_append_str(sp->nm,"\"");
+    json_emit_string(&sp->emit, *port);
     port++;
-    if (*port) {
-      native_message_append_str(sp->nm,",");
+  }
+  json_emit_array_end(&sp->emit);
+}
+
+static void 
+stats_handler(struct ScratchProtocol *sp, const union ScratchArgs *args)
+{
+  const struct NativeMessageStats *stats = &sp->nm->stats;
+  const struct ScratchRecvStats *recv = &sp->recv_stats;
+  unsigned int c;
+  struct JSONEmitter *je = &sp->emit;
+  json_emit_object_begin(je);
+  json_emit_key(je, "reads");
+  json_emit_uint(je, stats->reads);
+  json_emit_key(je, "messagesIn");
+  json_emit_uint(je, stats->messages_in);
+  json_emit_key(je, "messagesPerRead");
+  json_emit_fixed(je, (stats->reads > 0
+		       ? (double)stats->messages_in / stats->reads : 0.0), 2);
+  json_emit_key(je, "writes");
+  json_emit_uint(je, stats->writes);
+  json_emit_key(je, "messagesOut");
+  json_emit_uint(je, stats->messages_out);
+  json_emit_key(je, "messagesPerWrite");
+  json_emit_fixed(je, (stats->writes > 0
+		       ? (double)stats->messages_out / stats->writes : 0.0), 2);
+  json_emit_key(je, "messagesDropped");
+  json_emit_uint(je, stats->messages_dropped);
+  json_emit_key(je, "pool");
+  json_emit_array_begin(je);
+  for (c = 0; c < NM_POOL_CLASSES; c++) {
+    json_emit_object_begin(je);
+    json_emit_key(je, "size");
+    json_emit_uint(je, native_message_pool_sizes[c]);
+    json_emit_key(je, "hits");
+    json_emit_uint(je, sp->nm->pool.hits[c]);
+    json_emit_key(je, "misses");
+    json_emit_uint(je, sp->nm->pool.misses[c]);
+    json_emit_object_end(je);
+  }
+  json_emit_array_end(je);
+  json_emit_key(je, "serialReads");
+  json_emit_uint(je, recv->reads);
+  json_emit_key(je, "serialMessages");
+  json_emit_uint(je, recv->messages);
+  json_emit_key(je, "readsPerMessage");
+  json_emit_fixed(je, (recv->messages > 0
+		       ? (double)recv->reads / recv->messages : 0.0), 2);
+  json_emit_key(je, "coalesced");
+  json_emit_uint(je, recv->delayed);
+  json_emit_key(je, "coalesceDelayAvg");
+  json_emit_fixed(je, (recv->delayed > 0
+		       ? recv->delay_total / 1000.0 / recv->delayed : 0.0), 3);
+  json_emit_key(je, "coalesceDelayMax");
+  json_emit_fixed(je, recv->delay_max / 1000.0, 3);
+  json_emit_key(je, "framesDropped");
+  json_emit_uint(je, recv->frames_dropped);
+  json_emit_key(je, "framesSuppressed");
+  json_emit_uint(je, recv->frames_suppressed);
+  json_emit_key(je, "bytesSuppressed");
+  json_emit_uint(je, recv->bytes_suppressed);
+  json_emit_key(je, "pollQueries");
+  json_emit_uint(je, recv->poll_queries);
+  json_emit_key(je, "pollResponses");
+  json_emit_uint(je, recv->poll_responses);
+  json_emit_key(je, "pollTimeouts");
+  json_emit_uint(je, recv->poll_timeouts);
+  json_emit_key(je, "pollLateMax");
+  json_emit_fixed(je, recv->poll_late_max / 1000.0, 3);
+  json_emit_key(je, "serialBytes");
+  json_emit_uint(je, recv->bytes);
+  json_emit_key(je, "creditStalls");
+  json_emit_uint(je, sp->credit.stalls);
+  json_emit_object_end(je);
+}
+
+/* Upper limits of the coalescing options */
+#define COALESCE_DELAY_MAX 10000000 /* Microseconds */
+#define COALESCE_BYTES_MAX (1024*1024)
+#define CODEC_INTERVAL_MAX 10000000 /* Microseconds */
+#define HEARTBEAT_MAX 3600000000U /* Microseconds */
+
+/* Values of the framing option, indexed by SERIAL_FRAMING_* */
+static const char *const framing_names[] =
+  {
+    "none",
+    "line",
+    "slip",
+    "cobs",
+    "fixed",
+    "length",
+    NULL
+  };
+
+static int
+parse_framing(const struct JSONIndex *idx, int v, uint8_t *framing)
+{
+  char name[10];
+  unsigned int i;
+  if (!json_index_get_string(idx, v, name, sizeof(name))) return 0;
+  for (i = 0; framing_names[i]; i++) {
+    if (strcmp(name, framing_names[i]) == 0) {
+      *framing = i;
+      return 1;
     }
   }
-  native_message_append_str(sp->nm,"]");
+  return 0;
+}
+
+static int
+parse_codec(const struct JSONIndex *idx, int v,
+	    const struct DeviceCodecClass **codec)
+{
+  char name[20];
+  if (!json_index_get_string(idx, v, name, sizeof(name))) return 0;
+  if (strcmp(name, "none") == 0) {
+    *codec = NULL;
+    return 1;
+  }
+  *codec = device_codec_lookup(name);
+  return *codec != NULL;
 }
 
 struct SerialOpts default_serial_opts =
@@ -35,258 +157,1169 @@ struct SerialOpts default_serial_opts =
     1,
     8,
     0,
-    1
+    1,
+    0,
+    0,
+    SERIAL_FRAMING_NONE,
+    '\n',
+    1,
+    0,
+    0,
+    NULL,
+    0,
+    0,
+    0
   };
 
 static int
-serial_opts_cb(const uint8_t **pp, const char *key, void *cb_data)
+parse_serial_opts(const struct JSONIndex *idx, int obj,
+		  struct SerialOpts *opts)
 {
-  struct SerialOpts *opts = cb_data;
-  long v;
-  if (strcmp(key, "bitRate") == 0) {
-    if (!json_parse_int(pp, &v)) {
-      PRINTERR("Failed to parse bitRate value\n");
-      return 0;
-    }
-    opts->bitRate = v;
-  } else if (strcmp(key, "bufferSize") == 0) {
-    if (!json_parse_int(pp, &v)) {
-      PRINTERR("Failed to parse bufferSize value\n");
-      return 0;
-    }
-    opts->bufferSize = v;
-  } else if (strcmp(key, "ctsFlowControl") == 0) {
-    if (!json_parse_int(pp, &v)) {
-      PRINTERR("Failed to parse ctsFlowControl value\n");
-      return 0;
-    }
-    opts->ctsFlowControl = v;
-  } else if (strcmp(key, "dataBits") == 0) {
-    if (!json_parse_int(pp, &v)) {
-      PRINTERR("Failed to parse dataBits value\n");
-      return 0;
-    }
-    opts->dataBits = v;
-  } else if (strcmp(key, "parityBit") == 0) {
-    if (!json_parse_int(pp, &v)) {
-      PRINTERR("Failed to parse parityBit value\n");
-      return 0;
+  int k;
+  if (json_index_type(idx, obj) != JSON_OBJECT) {
+    PRINTERR("Serial options is not an object\n");
+    return 0;
+  }
+  for (k = json_index_child(idx, obj); k >= 0;
+       k = json_index_next(idx, obj, k + 1)) {
+    char key[20];
+    int v = k + 1; /* Keys have no children */
+    int id;
+    int ok = 0;
+    if (!json_index_get_string(idx, k, key, sizeof(key))) continue;
+    id = serial_opt_lookup(key);
+    switch(id) {
+    case -1:
+      continue;
+    case SERIAL_OPT_BITRATE:
+      ok = json_index_get_u32(idx, v, &opts->bitRate);
+      break;
+    case SERIAL_OPT_BUFFERSIZE:
+      ok = json_index_get_u32(idx, v, &opts->bufferSize);
+      break;
+    case SERIAL_OPT_CTSFLOWCONTROL:
+      ok = json_index_get_u8(idx, v, &opts->ctsFlowControl);
+      break;
+    case SERIAL_OPT_DATABITS:
+      ok = json_index_get_u8(idx, v, &opts->dataBits);
+      break;
+    case SERIAL_OPT_PARITYBIT:
+      ok = json_index_get_u8(idx, v, &opts->parityBit);
+      break;
+    case SERIAL_OPT_STOPBITS:
+      ok = json_index_get_u8(idx, v, &opts->stopBits);
+      break;
+    case SERIAL_OPT_COALESCEDELAY:
+      {
+	/* Milliseconds, with fractions */
+	int64_t us;
+	ok = (json_index_get_fixed(idx, v, 3, &us)
+	      && us >= 0 && us <= COALESCE_DELAY_MAX);
+	if (ok) opts->coalesceDelay = us;
+      }
+      break;
+    case SERIAL_OPT_COALESCEBYTES:
+      ok = (json_index_get_u32(idx, v, &opts->coalesceBytes)
+	    && opts->coalesceBytes <= COALESCE_BYTES_MAX);
+      break;
+    case SERIAL_OPT_FRAMING:
+      ok = parse_framing(idx, v, &opts->framing);
+      break;
+    case SERIAL_OPT_DELIMITER:
+      ok = json_index_get_u8(idx, v, &opts->frameDelimiter);
+      break;
+    case SERIAL_OPT_LENGTHBYTES:
+      ok = json_index_get_u8(idx, v, &opts->lengthBytes);
+      break;
+    case SERIAL_OPT_FRAMELENGTH:
+      ok = json_index_get_u32(idx, v, &opts->frameLength);
+      break;
+    case SERIAL_OPT_MAXFRAME:
+      ok = json_index_get_u32(idx, v, &opts->maxFrame);
+      break;
+    case SERIAL_OPT_CODEC:
+      ok = parse_codec(idx, v, &opts->codec);
+      break;
+    case SERIAL_OPT_CODECINTERVAL:
+      {
+	/* Milliseconds, with fractions */
+	int64_t us;
+	ok = (json_index_get_fixed(idx, v, 3, &us)
+	      && us >= 0 && us <= CODEC_INTERVAL_MAX);
+	if (ok) opts->codecInterval = us;
+      }
+      break;
+    case SERIAL_OPT_DEDUP:
+      {
+	/* true or false, 0 or 1 is also accepted */
+	int dedup;
+	if (json_index_get_bool(idx, v, &dedup)) {
+	  opts->dedup = dedup;
+	  ok = 1;
+	} else {
+	  ok = json_index_get_u8(idx, v, &opts->dedup) && opts->dedup <= 1;
+	}
+      }
+      break;
+    case SERIAL_OPT_HEARTBEAT:
+      {
+	/* Milliseconds, with fractions */
+	int64_t us;
+	ok = (json_index_get_fixed(idx, v, 3, &us)
+	      && us >= 0 && us <= HEARTBEAT_MAX);
+	if (ok) opts->heartbeat = us;
+      }
+      break;
     }
-    opts->parityBit = v;
-  } else if (strcmp(key, "stopBits") == 0) {
-    if (!json_parse_int(pp, &v)) {
-      PRINTERR("Failed to parse stopBits value\n");
+    if (!ok) {
+      PRINTERR("Invalid %s value\n", key);
       return 0;
     }
-    opts->stopBits = v;
+  }
+  if (opts->dedup && opts->framing == SERIAL_FRAMING_NONE) {
+    PRINTERR("dedup needs framing\n");
+    return 0;
   }
   return 1;
 }
 
+#define CMD_FAIL_RET  json_emit_int(&sp->emit, 0);return
+static void 
+serial_open_raw_handler(struct ScratchProtocol *sp, const union ScratchArgs *args)
+{
+  struct SerialOpts opts = default_serial_opts;
+  const struct ScratchArgsSerialOpenRaw *a = &args->serial_open_raw;
+  int res;
+  
+  if (a->opts >= 0 && !parse_serial_opts(&sp->index, a->opts, &opts)) {
+    CMD_FAIL_RET;
+  }
+  res = sp->callbacks->serial_open(a->path, &opts, sp->serial_context);
+  if (!sp->deferred) json_emit_int(&sp->emit, res);
+}
+
+static void 
+serial_close_handler(struct ScratchProtocol *sp, const union ScratchArgs *args)
+{
+  json_emit_int(&sp->emit,
+		sp->callbacks->serial_close(args->serial_close.path,
+					    sp->serial_context));
+}
 
 
-int
-parse_path(const uint8_t **pp, struct ScratchProtocol *sp,
-	   char *path, unsigned int len)
+
+/* Limits for the size of the write buffer */
+#define WRITE_BUFFER_MIN 256
+#define WRITE_BUFFER_MAX (64*1024)
+
+struct WriterContext
 {
-  if (!json_skip_comma(pp)) {
-    PRINTERR("No comma before first parameter");
-    native_message_append_str(sp->nm, "0");
+  struct ScratchProtocol *sp;
+  void *port;
+  unsigned int fill; /* Bytes in write_buffer not yet written */
+  unsigned long written; /* Bytes written to the port */
+  struct Base64Decoder decoder;
+  int malformed;
+};
+
+static int
+writer_flush(struct WriterContext *ctxt)
+{
+  struct ScratchProtocol *sp = ctxt->sp;
+  if (ctxt->fill == 0) return 1;
+  if (!sp->callbacks->serial_write(ctxt->port, sp->write_buffer, ctxt->fill,
+				   sp->serial_context)) {
     return 0;
   }
-  if (!json_parse_string_buffer(pp, (uint8_t*)path, len)) {
-    PRINTERR("Failed to parse path to serial device");
-    native_message_append_str(sp->nm, "0");
-    return 0;
+  ctxt->written += ctxt->fill;
+  ctxt->fill = 0;
+  return 1;
+}
+
+static int
+string_writer(const uint8_t *block, unsigned int len, void *cb_data)
+{
+  struct WriterContext *ctxt = cb_data;
+  struct ScratchProtocol *sp = ctxt->sp;
+  while(len > 0) {
+    /* Number of characters that are guaranteed to fit in the buffer */
+    unsigned int n = (sp->write_capacity - ctxt->fill) / 3;
+    int w;
+    if (n < 2) {
+      if (!writer_flush(ctxt)) return 0;
+      continue;
+    }
+    n = (n - 1) * 4;
+    if (n > len) n = len;
+    w = base64_decode(&ctxt->decoder, sp->write_buffer + ctxt->fill, block, n);
+    if (w < 0) {
+      ctxt->malformed = 1;
+      return 0;
+    }
+    ctxt->fill += w;
+    block += n;
+    len -= n;
   }
   return 1;
 }
 
-#define CMD_FAIL_RET  native_message_append_str(sp->nm, "0");return
-static void 
-serial_open_raw_handler(const uint8_t **pp, struct ScratchProtocol *sp)
+/* Make the write buffer at least as big as the preferred write size
+   of the port */
+static int
+reserve_write_buffer(struct ScratchProtocol *sp, void *port)
 {
-  struct SerialOpts opts = default_serial_opts;
-  char path[50];
-  
-  if (!parse_path(pp, sp, path, sizeof(path))) return;
-  
-  json_skip_white(pp);
-  if (**pp == ',') {
-    char key[20];
-    (*pp)++;
-    json_skip_white(pp);
-    if (!json_iterate_object(pp,key, sizeof(key), serial_opts_cb, &opts)) {
-      CMD_FAIL_RET;
+  unsigned int size = sp->callbacks->serial_write_size(port,
+						       sp->serial_context);
+  uint8_t *buffer;
+  if (size < WRITE_BUFFER_MIN) size = WRITE_BUFFER_MIN;
+  if (size > WRITE_BUFFER_MAX) size = WRITE_BUFFER_MAX;
+  if (size <= sp->write_capacity) return 1;
+  buffer = realloc(sp->write_buffer, size);
+  if (!buffer) return 0;
+  sp->write_buffer = buffer;
+  sp->write_capacity = size;
+  return 1;
+}
+
+/* Decode a quoted base64 string to the write buffer, writing it to the
+   port whenever the buffer is full. The buffer may still hold data
+   afterwards. */
+static int
+decode_data(struct WriterContext *ctxt, const uint8_t *data)
+{
+  struct ScratchProtocol *sp = ctxt->sp;
+  int w;
+  ctxt->malformed = 0;
+  base64_decoder_init(&ctxt->decoder);
+  if (!json_parse_string(&data, string_writer, ctxt)) {
+    if (ctxt->malformed) {
+      PRINTERR("Malformed base64 data\n");
+    } else {
+      PRINTERR("Failed to write string to serial port\n");
     }
+    return 0;
   }
-  if (sp->callbacks->serial_open(path, &opts, sp->serial_context)) {
-    native_message_append_str(sp->nm, "1");
-  } else {
-    native_message_append_str(sp->nm, "0");
+  if (sp->write_capacity - ctxt->fill < 2 && !writer_flush(ctxt)) {
+    PRINTERR("Failed to write string to serial port\n");
+    return 0;
+  }
+  w = base64_decode_finish(&ctxt->decoder, sp->write_buffer + ctxt->fill);
+  if (w < 0) {
+    PRINTERR("Truncated base64 data\n");
+    return 0;
   }
+  ctxt->fill += w;
+  return 1;
 }
 
 static void 
-serial_close_handler(const uint8_t **pp, struct ScratchProtocol *sp)
+serial_send_raw_handler(struct ScratchProtocol *sp, const union ScratchArgs *args)
 {
-  char path[50];
+  struct WriterContext ctxt;
+  const struct ScratchArgsSerialSendRaw *a = &args->serial_send_raw;
+  ctxt.sp = sp;
   
-  if (!parse_path(pp, sp, path, sizeof(path))) return;
-
-  if (sp->callbacks->serial_close(path, sp->serial_context)) {
-    native_message_append_str(sp->nm, "1");
-  } else {
-    native_message_append_str(sp->nm, "0");
+  ctxt.port = sp->callbacks->serial_find(a->path, sp->serial_context);
+  if (!ctxt.port) {
+    PRINTERR("Trying to send to unopened path: %s\n", a->path);
+    CMD_FAIL_RET;
+  }
+  if (!reserve_write_buffer(sp, ctxt.port)) {
+    PRINTERR("Failed to allocate write buffer\n");
+    CMD_FAIL_RET;
   }
+  ctxt.fill = 0;
+  ctxt.written = 0;
+  if (!decode_data(&ctxt, json_index_text(&sp->index, a->data))) {
+    CMD_FAIL_RET;
+  }
+  if (!writer_flush(&ctxt)) {
+    PRINTERR("Failed to write string to serial port\n");
+    CMD_FAIL_RET;
+  }
+  json_emit_int(&sp->emit, 1);
 }
 
+/* Largest number of entries in serial_send_batch */
+#define SEND_BATCH_MAX 64
 
+/* Base64 characters decoded at a time when validating */
+#define VALIDATE_CHUNK 1024
 
-struct WriterContext
+struct ValidateContext
 {
-  void *serial_ctxt;
-  struct ScratchProtocol *sp;
-  struct ScratchSerialCallbacks *callbacks;
-  const char *path;
-  uint16_t decode_buffer;
-  uint16_t decode_shift;
+  struct Base64Decoder decoder;
+  uint8_t out[BASE64_DECODED_MAX(VALIDATE_CHUNK)];
 };
-  
+
 static int
-string_writer(const uint8_t *block, unsigned int len, void *cb_data)
+validate_cb(const uint8_t *block, unsigned int len, void *cb_data)
 {
-  struct WriterContext *ctxt = cb_data;
-  const struct ScratchSerialCallbacks *callbacks = ctxt->sp->callbacks;
-  void *serial_ctxt = ctxt->sp->serial_context;
-  const char *path = ctxt->path;
-  
-  uint8_t buf[16];
-  uint8_t buf_len = 0;
-  while(len-- > 0) {
-    uint8_t b = *block++;
-    uint8_t v;
-    if (b >= 'A' && b <= 'Z') {
-      v = b - 'A';
-    } else  if (b >= 'a' && b <= 'z') {
-      v = b - 'a' + 26;
-    } else  if (b >= '0' && b <= '9') {
-      v = b - '0' + 52;
-    }  else  if (b == '+') {
-      v = 62;
-    } else if (b == '/') {
-      v = 63;
-    } else {
+  struct ValidateContext *v = cb_data;
+  while(len > 0) {
+    unsigned int n = len < VALIDATE_CHUNK ? len : VALIDATE_CHUNK;
+    if (base64_decode(&v->decoder, v->out, block, n) < 0) return 0;
+    block += n;
+    len -= n;
+  }
+  return 1;
+}
+
+/* Decode a quoted base64 string without keeping the result. Returns 0
+   if it is malformed. */
+static int
+validate_data(const uint8_t *data)
+{
+  struct ValidateContext v;
+  base64_decoder_init(&v.decoder);
+  if (!json_parse_string(&data, validate_cb, &v)) return 0;
+  return base64_decode_finish(&v.decoder, v.out) >= 0;
+}
+
+/* Takes an array of [path, data] entries. The data for each port is
+   decoded into the write buffer in request order and written when the
+   buffer is full or the port has no more entries, so every port is
+   usually written once. All entries are validated first, so nothing of
+   a malformed entry is written. Replies with an array of 1 or 0 per
+   entry. */
+static void
+serial_send_batch_handler(struct ScratchProtocol *sp,
+			  const union ScratchArgs *args)
+{
+  const struct JSONIndex *idx = &sp->index;
+  int entries = args->serial_send_batch.entries;
+  int data[SEND_BATCH_MAX];
+  void *ports[SEND_BATCH_MAX];
+  uint8_t status[SEND_BATCH_MAX];
+  unsigned int group[SEND_BATCH_MAX]; /* Entries for the current port */
+  unsigned int n = json_index_count(idx, entries);
+  unsigned int i;
+  unsigned int j;
+  int e;
+  if (n > SEND_BATCH_MAX) {
+    PRINTERR("More than %d entries in batch\n", SEND_BATCH_MAX);
+    CMD_FAIL_RET;
+  }
+  /* Resolve all ports first */
+  for (i = 0, e = json_index_child(idx, entries); i < n;
+       i++, e = json_index_next(idx, entries, e)) {
+    char path[SCRATCH_PATH_MAX];
+    int p = json_index_array_get(idx, e, 0);
+    data[i] = json_index_array_get(idx, e, 1);
+    ports[i] = NULL;
+    status[i] = 0;
+    if (p < 0 || data[i] < 0 || json_index_type(idx, data[i]) != JSON_STRING
+	|| !json_index_get_string(idx, p, path, sizeof(path))) {
+      PRINTERR("Batch entry %u is not [path, data]\n", i);
+      continue;
+    }
+    if (!validate_data(json_index_text(idx, data[i]))) {
+      PRINTERR("Malformed base64 data in batch entry %u\n", i);
       continue;
     }
-    ctxt->decode_buffer = ctxt->decode_buffer << 6 | v;
-    ctxt->decode_shift += 6;
-    if (ctxt->decode_shift >= 8) {
-      ctxt->decode_shift -= 8;
-      buf[buf_len++] = ctxt->decode_buffer >> ctxt->decode_shift;
-      if (buf_len == sizeof(buf)) {
-	if (!callbacks->serial_write(path, buf, buf_len, serial_ctxt))
-	  return 0;
-	buf_len = 0;
+    ports[i] = sp->callbacks->serial_find(path, sp->serial_context);
+    if (!ports[i]) {
+      PRINTERR("Trying to send to unopened path: %s\n", path);
+    }
+  }
+  for (i = 0; i < n; i++) {
+    struct WriterContext ctxt;
+    unsigned int n_group = 0;
+    if (!ports[i]) continue;
+    ctxt.sp = sp;
+    ctxt.port = ports[i];
+    ctxt.fill = 0;
+    ctxt.written = 0;
+    if (!reserve_write_buffer(sp, ctxt.port)) {
+      PRINTERR("Failed to allocate write buffer\n");
+      break;
+    }
+    for (j = i; j < n; j++) {
+      if (ports[j] != ctxt.port) continue;
+      ports[j] = NULL; /* Done */
+      /* Only fails if writing does */
+      if (decode_data(&ctxt, json_index_text(idx, data[j]))) {
+	status[j] = 1;
+	group[n_group++] = j;
       }
     }
+    if (!writer_flush(&ctxt)) {
+      PRINTERR("Failed to write string to serial port\n");
+      while(n_group > 0) status[group[--n_group]] = 0;
+    }
+  }
+  json_emit_array_begin(&sp->emit);
+  for (i = 0; i < n; i++) {
+    json_emit_int(&sp->emit, status[i]);
   }
-  if (buf_len > 0) {
-    if (!callbacks->serial_write(path, buf, buf_len, serial_ctxt))
+  json_emit_array_end(&sp->emit);
+}
+
+/* Limits of the poll period */
+#define POLL_PERIOD_MIN 1000 /* Microseconds */
+#define POLL_PERIOD_MAX 3600000000U
+
+static int
+parse_poll_opts(const struct JSONIndex *idx, int obj, struct ScratchPoll *poll)
+{
+  int k;
+  if (json_index_type(idx, obj) != JSON_OBJECT) {
+    PRINTERR("Poll options is not an object\n");
+    return 0;
+  }
+  for (k = json_index_child(idx, obj); k >= 0;
+       k = json_index_next(idx, obj, k + 1)) {
+    char key[20];
+    int v = k + 1; /* Keys have no children */
+    int ok = 0;
+    int64_t us;
+    uint8_t delimiter;
+    if (!json_index_get_string(idx, k, key, sizeof(key))) continue;
+    switch(poll_opt_lookup(key)) {
+    case -1:
+      continue;
+    case POLL_OPT_PERIOD:
+      /* Milliseconds, with fractions */
+      ok = (json_index_get_fixed(idx, v, 3, &us)
+	    && us >= POLL_PERIOD_MIN && us <= POLL_PERIOD_MAX);
+      if (ok) poll->period = us;
+      break;
+    case POLL_OPT_TIMEOUT:
+      ok = (json_index_get_fixed(idx, v, 3, &us)
+	    && us > 0 && us <= POLL_PERIOD_MAX);
+      if (ok) poll->timeout = us;
+      break;
+    case POLL_OPT_DELIMITER:
+      ok = json_index_get_u8(idx, v, &delimiter);
+      if (ok) poll->delimiter = delimiter;
+      break;
+    case POLL_OPT_LENGTH:
+      ok = json_index_get_u32(idx, v, &poll->length);
+      break;
+    }
+    if (!ok) {
+      PRINTERR("Invalid %s value\n", key);
       return 0;
+    }
+  }
+  if (poll->period == 0) {
+    PRINTERR("No poll period\n");
+    return 0;
+  }
+  if (poll->timeout == 0 || poll->timeout > poll->period) {
+    poll->timeout = poll->period;
   }
   return 1;
 }
 
-static void 
-serial_send_raw_handler(const uint8_t **pp, struct ScratchProtocol *sp)
+/* Takes a path, a base64 encoded query and an object with the period
+   and how a response ends */
+static void
+serial_poll_start_handler(struct ScratchProtocol *sp,
+			  const union ScratchArgs *args)
 {
-  struct WriterContext ctxt;
-  char path[50];
-  ctxt.sp = sp;
-  
-  if (!parse_path(pp, sp, path, sizeof(path))) return;
-  if (!json_skip_comma(pp)) {
-    PRINTERR("No comma after path\n");
+  const struct ScratchArgsSerialPollStart *a = &args->serial_poll_start;
+  char encoded[BASE64_ENCODED_SIZE(SCRATCH_POLL_QUERY_MAX) + 1];
+  uint8_t decoded[BASE64_DECODED_MAX(sizeof(encoded))];
+  struct ScratchPoll poll;
+  struct Base64Decoder dec;
+  unsigned int len = 0;
+  void *port;
+  int r;
+  if (!sp->callbacks->serial_poll_start) {
     CMD_FAIL_RET;
   }
-  ctxt.path = path;
+  port = sp->callbacks->serial_find(a->path, sp->serial_context);
+  if (!port) {
+    PRINTERR("Trying to poll unopened path: %s\n", a->path);
+    CMD_FAIL_RET;
+  }
+  memset(&poll, 0, sizeof(poll));
+  poll.delimiter = -1;
+  if (!parse_poll_opts(&sp->index, a->opts, &poll)) {
+    CMD_FAIL_RET;
+  }
+  if (!json_index_get_string(&sp->index, a->query, encoded, sizeof(encoded))) {
+    PRINTERR("Poll query too long\n");
+    CMD_FAIL_RET;
+  }
+  base64_decoder_init(&dec);
+  r = base64_decode(&dec, decoded, (const uint8_t*)encoded, strlen(encoded));
+  if (r >= 0) {
+    len = r;
+    r = base64_decode_finish(&dec, decoded + len);
+  }
+  if (r < 0) {
+    PRINTERR("Malformed base64 data\n");
+    CMD_FAIL_RET;
+  }
+  len += r;
+  if (len == 0 || len > SCRATCH_POLL_QUERY_MAX) {
+    PRINTERR("Poll query must be 1 to %u bytes\n", SCRATCH_POLL_QUERY_MAX);
+    CMD_FAIL_RET;
+  }
+  memcpy(poll.query, decoded, len);
+  poll.query_len = len;
+  json_emit_int(&sp->emit,
+		sp->callbacks->serial_poll_start(port, &poll,
+						 sp->serial_context));
+}
 
-  ctxt.decode_shift = 0;
-  if (!json_parse_string(pp, string_writer, &ctxt)) {
-    PRINTERR("Failed to write string to serial port\n");
+static void
+serial_poll_stop_handler(struct ScratchProtocol *sp,
+			 const union ScratchArgs *args)
+{
+  void *port;
+  if (!sp->callbacks->serial_poll_stop) {
     CMD_FAIL_RET;
   }
-  native_message_append_str(sp->nm, "1");
+  port = sp->callbacks->serial_find(args->serial_poll_stop.path,
+				    sp->serial_context);
+  if (!port) {
+    CMD_FAIL_RET;
+  }
+  json_emit_int(&sp->emit,
+		sp->callbacks->serial_poll_stop(port, sp->serial_context));
+}
+
+/* Credits left. Negative if a read was sent in more messages or
+   bytes than there were credits for. */
+static long long
+credit_left(unsigned long long granted, unsigned long long spent)
+{
+  return (long long)(granted - spent);
+}
+
+/* Add n credits. Returns the new total granted. */
+static unsigned long long
+grant_credit(int on, unsigned long long granted, unsigned long long spent,
+	     uint32_t n, unsigned long max)
+{
+  long long left = on ? credit_left(granted, spent) : 0;
+  left += n;
+  if (max > 0 && left > (long long)max) left = max;
+  return spent + left;
+}
+
+static void
+emit_credit_left(struct JSONEmitter *je, int on,
+		 unsigned long long granted, unsigned long long spent)
+{
+  long long left = credit_left(granted, spent);
+  json_emit_int(je, !on ? -1 : left < 0 ? 0 : left);
+}
+
+/* Takes an optional object {"messages":n,"bytes":n} of credits to add.
+   The first grant of either turns on flow control for it, if the host
+   supports it. Replies with the credits left, -1 for those that aren't
+   enforced. */
+static void
+serial_credit_handler(struct ScratchProtocol *sp, const union ScratchArgs *args)
+{
+  const struct JSONIndex *idx = &sp->index;
+  struct ScratchCredit *c = &sp->credit;
+  int grant = args->serial_credit.grant;
+  if (grant >= 0 && c->supported) {
+    uint32_t messages = 0;
+    uint32_t bytes = 0;
+    int m = json_index_object_get(idx, grant, "messages");
+    int b = json_index_object_get(idx, grant, "bytes");
+    if ((m >= 0 && !json_index_get_u32(idx, m, &messages))
+	|| (b >= 0 && !json_index_get_u32(idx, b, &bytes))) {
+      PRINTERR("Invalid credit grant\n");
+      CMD_FAIL_RET;
+    }
+    if (m >= 0) {
+      c->messages_granted = grant_credit(c->messages_on, c->messages_granted,
+					 c->messages_spent, messages,
+					 c->max_messages);
+      c->messages_on = 1;
+    }
+    if (b >= 0) {
+      c->bytes_granted = grant_credit(c->bytes_on, c->bytes_granted,
+				      c->bytes_spent, bytes, c->max_bytes);
+      c->bytes_on = 1;
+    }
+  }
+  json_emit_object_begin(&sp->emit);
+  json_emit_key(&sp->emit, "messages");
+  emit_credit_left(&sp->emit, c->messages_on,
+		   c->messages_granted, c->messages_spent);
+  json_emit_key(&sp->emit, "bytes");
+  emit_credit_left(&sp->emit, c->bytes_on, c->bytes_granted, c->bytes_spent);
+  json_emit_object_end(&sp->emit);
 }
 
-struct CommandMap
+/* Takes an optional object of requested capabilities. Unknown ones are
+   ignored. Replies with the capabilities in effect, including whether
+   serial_credit is enforced. */
+static void
+capabilities_handler(struct ScratchProtocol *sp, const union ScratchArgs *args)
 {
-  const char *command;
-  void (*handler)(const uint8_t **pp, struct ScratchProtocol *sp);
-} command_map [] =
+  const struct JSONIndex *idx = &sp->index;
+  int caps = args->capabilities.caps;
+  if (caps >= 0) {
+    int binary;
+    int v = json_index_object_get(idx, caps, "binary");
+    if (v >= 0) {
+      long value;
+      if (json_index_get_int(idx, v, &value)) {
+	binary = value != 0;
+      } else if (!json_index_get_bool(idx, v, &binary)) {
+	PRINTERR("Capability binary must be a boolean\n");
+	CMD_FAIL_RET;
+      }
+      sp->binary = binary;
+    }
+  }
+  json_emit_object_begin(&sp->emit);
+  json_emit_key(&sp->emit, "binary");
+  json_emit_bool(&sp->emit, sp->binary);
+  json_emit_key(&sp->emit, "credit");
+  json_emit_bool(&sp->emit, sp->credit.supported);
+  json_emit_object_end(&sp->emit);
+}
+
+/* Indexed by SCRATCH_CMD_*. A command without a handler is treated as
+   unknown. */
+static void
+(*const command_handlers[SCRATCH_CMD_COUNT])(struct ScratchProtocol *sp,
+					     const union ScratchArgs *args) =
   {
-    {"version", version_handler},
-    {"serial_list", serial_list_handler},
-    {"serial_open_raw", serial_open_raw_handler},
-    {"serial_close", serial_close_handler},
-    {"serial_send_raw", serial_send_raw_handler},
-    {NULL, NULL}
+    [SCRATCH_CMD_VERSION] = version_handler,
+    [SCRATCH_CMD_SERIAL_LIST] = serial_list_handler,
+    [SCRATCH_CMD_SERIAL_OPEN_RAW] = serial_open_raw_handler,
+    [SCRATCH_CMD_SERIAL_CLOSE] = serial_close_handler,
+    [SCRATCH_CMD_SERIAL_SEND_RAW] = serial_send_raw_handler,
+    [SCRATCH_CMD_STATS] = stats_handler,
+    [SCRATCH_CMD_CAPABILITIES] = capabilities_handler,
+    [SCRATCH_CMD_SERIAL_SEND_BATCH] = serial_send_batch_handler,
+    [SCRATCH_CMD_SERIAL_POLL_START] = serial_poll_start_handler,
+    [SCRATCH_CMD_SERIAL_POLL_STOP] = serial_poll_stop_handler,
+    [SCRATCH_CMD_SERIAL_CREDIT] = serial_credit_handler
   };
 
+/* Start of a reply: ["@",token, */
+static void
+begin_reply(struct ScratchProtocol *sp, const char *token)
+{
+  json_emit_reset(&sp->emit);
+  json_emit_array_begin(&sp->emit);
+  json_emit_string(&sp->emit, "@");
+  json_emit_string(&sp->emit, token);
+}
 
+static void
+end_reply(struct ScratchProtocol *sp)
+{
+  json_emit_array_end(&sp->emit);
+  PRINTDEBUG("Reply: %d '%.*s'\n", sp->nm->out_len-4, sp->nm->out_len-4,
+	     sp->nm->out_buffer+4);
+  native_message_send(sp->nm);
+}
+
+void
+scratch_protocol_defer_reply(struct ScratchProtocol *sp,
+			     struct ScratchDeferredReply *reply)
+{
+  strcpy(reply->token, sp->token);
+  native_message_discard(sp->nm);
+  sp->deferred = 1;
+}
+
+void
+scratch_protocol_complete(struct ScratchProtocol *sp,
+			  const struct ScratchDeferredReply *reply, int result)
+{
+  begin_reply(sp, reply->token);
+  json_emit_int(&sp->emit, result);
+  end_reply(sp);
+}
+
+int
+scratch_protocol_send_state(struct ScratchProtocol *sp, const char *path,
+			    struct DeviceCodec *codec)
+{
+  struct JSONEmitter je;
+  json_emit_init(&je, sp->nm);
+  if (!json_emit_array_begin(&je)
+      || !json_emit_string(&je, "deviceState")
+      || !json_emit_string(&je, path)
+      || !codec->cls->emit(codec, &je)
+      || !json_emit_array_end(&je)) {
+    PRINTERR("Failed to build state update for %s\n", path);
+    native_message_discard(sp->nm);
+    return 0;
+  }
+  native_message_send(sp->nm);
+  sp->recv_stats.messages++;
+  return 1;
+}
+
+void
+scratch_protocol_send_poll_response(struct ScratchProtocol *sp,
+				    const char *path,
+				    const uint8_t *data, unsigned int len,
+				    uint64_t sent_us, uint64_t received_us)
+{
+  struct JSONEmitter je;
+  json_emit_init(&je, sp->nm);
+  json_emit_array_begin(&je);
+  json_emit_string(&je, "serialPoll");
+  json_emit_string(&je, path);
+  json_emit_base64(&je, data, len);
+  json_emit_fixed(&je, sent_us / 1000.0, 3);
+  json_emit_fixed(&je, received_us / 1000.0, 3);
+  json_emit_array_end(&je);
+  native_message_send_data(sp->nm);
+  sp->recv_stats.poll_responses++;
+  sp->recv_stats.messages++;
+  sp->recv_stats.bytes += len;
+}
+
+void
+scratch_protocol_set_credit_limits(struct ScratchProtocol *sp,
+				   unsigned long max_messages,
+				   unsigned long max_bytes)
+{
+  sp->credit.supported = 1;
+  sp->credit.max_messages = max_messages;
+  sp->credit.max_bytes = max_bytes;
+}
+
+void
+scratch_protocol_count_recv(struct ScratchProtocol *sp, unsigned int len)
+{
+  sp->recv_stats.messages++;
+  sp->recv_stats.bytes += len;
+  sp->credit.messages_spent++;
+  sp->credit.bytes_spent += len;
+}
+
+int
+scratch_protocol_credit_available(const struct ScratchProtocol *sp)
+{
+  const struct ScratchCredit *c = &sp->credit;
+  return ((!c->messages_on || c->messages_granted > c->messages_spent)
+	  && (!c->bytes_on || c->bytes_granted > c->bytes_spent));
+}
+
+unsigned int
+scratch_protocol_binary_recv_header(uint8_t *out, const char *path)
+{
+  unsigned int path_len = strlen(path);
+  if (path_len > 255) return 0;
+  out[0] = SCRATCH_BINARY_MARK;
+  out[1] = SCRATCH_BINARY_RECV;
+  out[2] = path_len;
+  memcpy(out + 3, path, path_len);
+  return SCRATCH_BINARY_RECV_HEADER(path_len);
+}
+
+/* Handle a SCRATCH_BINARY_SEND frame */
+static void
+binary_send_handler(struct ScratchProtocol *sp,
+		    const uint8_t *msg, unsigned int len)
+{
+  char token[SCRATCH_TOKEN_MAX];
+  char path[SCRATCH_PATH_MAX];
+  unsigned int token_len;
+  unsigned int path_len;
+  void *port;
+  int ok = 0;
+  msg += 2;
+  len -= 2;
+  if (len < 1 || msg[0] >= sizeof(token) || msg[0] + 2U > len) {
+    PRINTERR("Truncated binary frame\n");
+    return;
+  }
+  token_len = msg[0];
+  memcpy(token, msg + 1, token_len);
+  token[token_len] = '\0';
+  msg += token_len + 1;
+  len -= token_len + 1;
+  begin_reply(sp, token);
+  path_len = msg[0];
+  if (path_len >= sizeof(path) || path_len + 1 > len) {
+    PRINTERR("Invalid path in binary frame\n");
+  } else {
+    memcpy(path, msg + 1, path_len);
+    path[path_len] = '\0';
+    msg += path_len + 1;
+    len -= path_len + 1;
+    port = sp->callbacks->serial_find(path, sp->serial_context);
+    if (!port) {
+      PRINTERR("Trying to send to unopened path: %s\n", path);
+    } else if (!sp->callbacks->serial_write(port, msg, len,
+					    sp->serial_context)) {
+      PRINTERR("Failed to write to serial port\n");
+    } else {
+      ok = 1;
+    }
+  }
+  json_emit_int(&sp->emit, ok);
+  end_reply(sp);
+}
 
 void 
 scratch_protocol_message_handler(struct ScratchProtocol *sp, 
 				 const uint8_t *msg, unsigned int len)
 {
-  const uint8_t *p = msg;
-  struct CommandMap *cmd = command_map;
-  uint8_t token[20];
-  uint8_t command[20];
-  struct JSONStringBuffer str;
-  json_skip_white(&p);
-  if (*p != '[') {
+  const struct JSONIndex *idx = &sp->index;
+  union ScratchArgs args;
+  char command[20];
+  int id;
+  int e;
+  if (len >= 2 && msg[0] == SCRATCH_BINARY_MARK) {
+    if (!sp->binary) {
+      PRINTERR("Binary frame received without negotiating binary mode\n");
+    } else if (msg[1] == SCRATCH_BINARY_SEND) {
+      binary_send_handler(sp, msg, len);
+    } else {
+      PRINTERR("Unknown binary frame type %u\n", msg[1]);
+    }
+    return;
+  }
+  if (!json_index_build(&sp->index, msg)) {
+    PRINTERR("Request is not valid JSON\n");
+    return;
+  }
+  if (json_index_type(idx, 0) != JSON_ARRAY) {
     PRINTERR("Request is not an array\n");
+    return;
   }
-  p++;
-  str.data = token;
-  str.capacity = sizeof(token);
-  str.length = 0;
-  if (!json_parse_string(&p, json_string_callback, &str)) {
+  e = json_index_array_get(idx, 0, 0);
+  if (e < 0 || !json_index_get_string(idx, e, sp->token, sizeof(sp->token))) {
     PRINTERR("Failed to parse request id\n");
     return;
   }
-  token[str.length] = '\0';
-  if (!json_skip_comma(&p)) {
-    PRINTERR("Expected comma\n");
-  }
-  if (*p != '[') {
+  sp->command = json_index_array_get(idx, 0, 1);
+  if (sp->command < 0 || json_index_type(idx, sp->command) != JSON_ARRAY) {
     PRINTERR("Message is not an array\n");
+    return;
   }
-  p++;
-  str.data = command;
-  str.capacity = sizeof(command);
-  str.length = 0;
-  if (!json_parse_string(&p, json_string_callback, &str)) {
+  e = json_index_array_get(idx, sp->command, 0);
+  if (e < 0 || !json_index_get_string(idx, e, command, sizeof(command))) {
     PRINTERR("Failed to parse command id\n");
     return;
   }
-  command[str.length] = '\0';
   PRINTDEBUG("Command: %s\n", command);
-  
-  while (cmd->command) {
-    if (strcmp((const char*)command, cmd->command) == 0) {
-      native_message_printf(sp->nm,"[\"@\",\"%s\",", token); 
-      cmd->handler(&p, sp);
-      native_message_append_str(sp->nm,"]");
-      sp->nm->out_buffer[sp->nm->out_len] = '\0';
-      PRINTDEBUG("Reply: %d '%s'\n", sp->nm->out_len-4, sp->nm->out_buffer+4);
-      native_message_send(sp->nm);
-      break;
+  id = scratch_command_lookup(command);
+  if (id < 0 || !command_handlers[id]) {
+    PRINTERR("Unknown command %s\n", command);
+    return;
+  }
+  begin_reply(sp, sp->token);
+  if (scratch_args_parse(id, idx, sp->command, &args)) {
+    command_handlers[id](sp, &args);
+  } else {
+    json_emit_int(&sp->emit, 0);
+  }
+  if (sp->deferred) {
+    sp->deferred = 0;
+    return;
+  }
+  end_reply(sp);
+}
+
+/* Longest start of a request searched for the data of serial_send_raw */
+#define STREAM_PREFIX_MAX NM_STREAM_PREFIX
+
+/* States of a streamed request */
+#define STREAM_DATA 0 /* Decoding the base64 string */
+#define STREAM_TAIL 1 /* After the data string */
+#define STREAM_RAW 2 /* Data of a binary frame */
+#define STREAM_FAILED 3 /* Discarding the rest, the reply is 0 */
+
+struct ScratchStream
+{
+  int state;
+  uint8_t prefix[STREAM_PREFIX_MAX + 1 + JSON_PARSE_PADDING];
+  unsigned int prefix_len;
+  unsigned int skip; /* Bytes of the prefix before the data */
+  char token[SCRATCH_TOKEN_MAX];
+  char path[SCRATCH_PATH_MAX]; /* Port the data is written to */
+  struct WriterContext writer;
+  int escape; /* The last data character was a backslash */
+  unsigned int brackets; /* Closing brackets seen in STREAM_TAIL */
+};
+
+/* Returns 1 and skips c if it is next, after any white space. Returns 0
+   if the prefix ends first and -1 for anything else. */
+static int
+prefix_expect(const uint8_t **pp, uint8_t c)
+{
+  json_skip_white(pp);
+  if (**pp == c) {
+    (*pp)++;
+    return 1;
+  }
+  return **pp == '\0' ? 0 : -1;
+}
+
+/* Parse a string from the prefix. A string that doesn't end before the
+   prefix does is only an error if the prefix is full. */
+static int
+prefix_string(struct ScratchStream *st, const uint8_t **pp,
+	      char *buffer, unsigned int size)
+{
+  json_skip_white(pp);
+  if (**pp == '\0') return 0;
+  if (json_parse_string_buffer(pp, (uint8_t*)buffer, size)) return 1;
+  return st->prefix_len < STREAM_PREFIX_MAX ? 0 : -1;
+}
+
+#define PREFIX_CHECK(x) do {int r = (x); if (r <= 0) return r;} while(0)
+
+/* Look for ["token",["serial_send_raw","path"," at the start of a
+   JSON request. Returns the offset of the data, 0 if more of the
+   message is needed or -1 if the request is something else. */
+static int
+match_json_prefix(struct ScratchStream *st, char *path)
+{
+  char command[20];
+  const uint8_t *p = st->prefix;
+  PREFIX_CHECK(prefix_expect(&p, '['));
+  PREFIX_CHECK(prefix_string(st, &p, st->token, sizeof(st->token)));
+  PREFIX_CHECK(prefix_expect(&p, ','));
+  PREFIX_CHECK(prefix_expect(&p, '['));
+  PREFIX_CHECK(prefix_string(st, &p, command, sizeof(command)));
+  if (scratch_command_lookup(command) != SCRATCH_CMD_SERIAL_SEND_RAW) {
+    return -1;
+  }
+  PREFIX_CHECK(prefix_expect(&p, ','));
+  PREFIX_CHECK(prefix_string(st, &p, path, SCRATCH_PATH_MAX));
+  PREFIX_CHECK(prefix_expect(&p, ','));
+  PREFIX_CHECK(prefix_expect(&p, '"'));
+  return p - st->prefix;
+}
+
+/* Same for the header of a SCRATCH_BINARY_SEND frame */
+static int
+match_binary_prefix(struct ScratchStream *st, char *path)
+{
+  const uint8_t *p = st->prefix;
+  unsigned int token_len;
+  unsigned int path_len;
+  if (st->prefix_len < 3) return 0;
+  if (p[1] != SCRATCH_BINARY_SEND) return -1;
+  token_len = p[2];
+  if (token_len >= sizeof(st->token)) return -1;
+  if (st->prefix_len < 4 + token_len) return 0;
+  path_len = p[3 + token_len];
+  if (path_len >= SCRATCH_PATH_MAX) return -1;
+  if (st->prefix_len < 4 + token_len + path_len) return 0;
+  memcpy(st->token, p + 3, token_len);
+  st->token[token_len] = '\0';
+  memcpy(path, p + 4 + token_len, path_len);
+  path[path_len] = '\0';
+  return 4 + token_len + path_len;
+}
+
+/* Write a part of the data string. Returns 0 on failure. */
+static int
+stream_write(struct ScratchStream *st, const uint8_t *data, unsigned int len)
+{
+  if (string_writer(data, len, &st->writer)) return 1;
+  if (st->writer.malformed) {
+    PRINTERR("Malformed base64 data\n");
+  } else {
+    PRINTERR("Failed to write string to serial port\n");
+  }
+  st->state = STREAM_FAILED;
+  return 0;
+}
+
+/* Decode and write part of the data string. Of the escapes only \/
+   and whitespace can occur in base64 data. */
+static void
+stream_data_string(struct ScratchStream *st,
+		   const uint8_t *data, unsigned int len)
+{
+  static const uint8_t slash = '/';
+  static const uint8_t space = ' ';
+  while(len > 0 && st->state == STREAM_DATA) {
+    unsigned int run = 0;
+    uint8_t c = *data;
+    if (st->escape) {
+      st->escape = 0;
+      if (c != '/' && c != 'n' && c != 'r' && c != 't') {
+	PRINTERR("Malformed base64 data\n");
+	st->state = STREAM_FAILED;
+	return;
+      }
+      if (!stream_write(st, c == '/' ? &slash : &space, 1)) return;
+      run = 1;
+    } else if (c == '\\') {
+      st->escape = 1;
+      run = 1;
+    } else if (c == '"') {
+      st->state = STREAM_TAIL;
+      run = 1;
+    } else {
+      while(run < len && data[run] != '"' && data[run] != '\\') run++;
+      if (!stream_write(st, data, run)) return;
     }
-    cmd++;
+    data += run;
+    len -= run;
   }
+  /* Only white space and the two closing brackets may follow */
+  while(len > 0 && st->state == STREAM_TAIL) {
+    uint8_t c = *data++;
+    len--;
+    if (c == ']' && st->brackets < 2) {
+      st->brackets++;
+    } else if (c != ' ' && c != '\t' && c != '\n' && c != '\r') {
+      PRINTERR("Unexpected data after serial_send_raw\n");
+      st->state = STREAM_FAILED;
+    }
+  }
+}
+
+/* The port may have been closed since the last data was received, so
+   it is looked up again. Fails the stream if it is gone. */
+static int
+stream_find_port(struct ScratchProtocol *sp, struct ScratchStream *st)
+{
+  st->writer.port = sp->callbacks->serial_find(st->path, sp->serial_context);
+  if (!st->writer.port) {
+    PRINTERR("%s was closed while sending to it\n", st->path);
+    st->state = STREAM_FAILED;
+    return 0;
+  }
+  return 1;
+}
+
+static void
+stream_feed(struct ScratchProtocol *sp, struct ScratchStream *st,
+	    const uint8_t *data, unsigned int len)
+{
+  if ((st->state == STREAM_DATA || st->state == STREAM_TAIL
+       || st->state == STREAM_RAW) && !stream_find_port(sp, st)) {
+    return;
+  }
+  switch(st->state) {
+  case STREAM_DATA:
+  case STREAM_TAIL:
+    stream_data_string(st, data, len);
+    break;
+  case STREAM_RAW:
+    if (len > 0 && !sp->callbacks->serial_write(st->writer.port, data, len,
+						sp->serial_context)) {
+      PRINTERR("Failed to write to serial port\n");
+      st->state = STREAM_FAILED;
+    }
+    break;
+  }
+}
+
+/* The start of the data has been found */
+static void
+stream_start_data(struct ScratchProtocol *sp, struct ScratchStream *st,
+		  const char *path, int binary)
+{
+  void *port = sp->callbacks->serial_find(path, sp->serial_context);
+  st->state = STREAM_FAILED;
+  if (!port) {
+    PRINTERR("Trying to send to unopened path: %s\n", path);
+    return;
+  }
+  strcpy(st->path, path);
+  st->writer.sp = sp;
+  st->writer.port = port;
+  if (binary) {
+    st->state = STREAM_RAW;
+    return;
+  }
+  if (!reserve_write_buffer(sp, port)) {
+    PRINTERR("Failed to allocate write buffer\n");
+    return;
+  }
+  st->writer.fill = 0;
+  st->writer.written = 0;
+  st->writer.malformed = 0;
+  base64_decoder_init(&st->writer.decoder);
+  st->escape = 0;
+  st->brackets = 0;
+  st->state = STREAM_DATA;
+}
+
+/* The whole request has been received */
+static void
+stream_end(struct ScratchProtocol *sp, struct ScratchStream *st)
+{
+  struct WriterContext *ctxt = &st->writer;
+  int ok = 0;
+  int w;
+  if (st->state == STREAM_DATA) {
+    PRINTERR("Unterminated data string\n");
+  } else if (st->state == STREAM_TAIL && st->brackets < 2) {
+    PRINTERR("Truncated serial_send_raw request\n");
+  } else if (st->state == STREAM_TAIL) {
+    if (sp->write_capacity - ctxt->fill < 2 && !writer_flush(ctxt)) {
+      PRINTERR("Failed to write string to serial port\n");
+    } else if ((w = base64_decode_finish(&ctxt->decoder,
+					 sp->write_buffer + ctxt->fill)) < 0) {
+      PRINTERR("Truncated base64 data\n");
+    } else {
+      ctxt->fill += w;
+      if (!writer_flush(ctxt)) {
+	PRINTERR("Failed to write string to serial port\n");
+      } else {
+	ok = 1;
+      }
+    }
+  } else if (st->state == STREAM_RAW) {
+    ok = 1;
+  }
+  begin_reply(sp, st->token);
+  json_emit_int(&sp->emit, ok);
+  end_reply(sp);
+}
+
+int
+scratch_protocol_stream_begin(struct ScratchProtocol *sp,
+			      const uint8_t *start, unsigned int start_len)
+{
+  struct ScratchStream *st = sp->stream;
+  char path[SCRATCH_PATH_MAX];
+  int binary;
+  int offset;
+  if (!st) {
+    st = malloc(sizeof(struct ScratchStream));
+    if (!st) return 0;
+    sp->stream = st;
+  }
+  if (start_len > STREAM_PREFIX_MAX) start_len = STREAM_PREFIX_MAX;
+  memcpy(st->prefix, start, start_len);
+  st->prefix_len = start_len;
+  st->prefix[start_len] = '\0';
+  binary = st->prefix[0] == SCRATCH_BINARY_MARK;
+  if (binary) {
+    offset = sp->binary ? match_binary_prefix(st, path) : -1;
+  } else {
+    offset = match_json_prefix(st, path);
+  }
+  if (offset <= 0) return 0;
+  stream_start_data(sp, st, path, binary);
+  st->skip = offset;
+  return 1;
+}
+
+void
+scratch_protocol_stream_data(struct ScratchProtocol *sp,
+			     const uint8_t *data, unsigned int len, int last)
+{
+  struct ScratchStream *st = sp->stream;
+  if (st->skip > 0) {
+    /* Already parsed by scratch_protocol_stream_begin */
+    unsigned int n = st->skip < len ? st->skip : len;
+    st->skip -= n;
+    data += n;
+    len -= n;
+  }
+  stream_feed(sp, st, data, len);
+  if (last) stream_end(sp, st);
 }
 
 void
@@ -297,9 +1330,28 @@ scratch_protocol_init(struct ScratchProtocol *sp, struct NativeMessage *nm,
   sp->nm = nm;
   sp->callbacks = callbacks;
   sp->serial_context = context;
+  sp->write_buffer = NULL;
+  sp->write_capacity = 0;
+  sp->binary = 0;
+  sp->command = -1;
+  memset(&sp->recv_stats, 0, sizeof(sp->recv_stats));
+  memset(&sp->credit, 0, sizeof(sp->credit));
+  sp->deferred = 0;
+  sp->token[0] = '\0';
+  sp->stream = NULL;
+  json_index_init(&sp->index);
+  json_emit_init(&sp->emit, nm);
 }
 
 void
 scratch_protocol_destroy(struct ScratchProtocol *sp)
 {
+  json_index_destroy(&sp->index);
+  free(sp->write_buffer);
+  sp->write_buffer = NULL;
+  if (sp->stream) {
+    free(sp->stream);
+    sp->stream = NULL;
+  }
+  sp->write_capacity = 0;
 }
@@ -2,23 +2,139 @@
 #define __SCRATCH_PROTOCOL_H__P954VNN5E4__
 
 #include <serial.h>
+#include <json_index.h>
+#include <json_emit.h>
+#include <device_codec.h>
 #include <scratch_protocol.h>
 
+/* Binary framing. Enabled by a client sending
+   ["capabilities",{"binary":true}]. A message starting with
+   SCRATCH_BINARY_MARK instead of JSON is a binary frame. The second
+   byte is the frame type:
+
+   SCRATCH_BINARY_SEND (client to host): u8 token length, token,
+   u8 path length, path, raw data. Replied to like serial_send_raw.
+
+   SCRATCH_BINARY_RECV (host to client): u8 path length, path, raw
+   data. Sent instead of serialRecv.
+
+   All other messages are still JSON. */
+#define SCRATCH_BINARY_MARK 0x00
+#define SCRATCH_BINARY_SEND 'S'
+#define SCRATCH_BINARY_RECV 'R'
+
+/* Size of request tokens, including the terminating '\0' */
+#define SCRATCH_TOKEN_MAX 20
+
+/* Length of the header of a binary frame with a path of path_len bytes */
+#define SCRATCH_BINARY_RECV_HEADER(path_len) (3 + (path_len))
+
+/* Largest query of serial_poll_start */
+#define SCRATCH_POLL_QUERY_MAX 256
+
+/* A query sent periodically by the host. The response is what is
+   received until delimiter or length bytes, or until the timeout. */
+struct ScratchPoll
+{
+  uint8_t query[SCRATCH_POLL_QUERY_MAX];
+  unsigned int query_len;
+  uint32_t period; /* Microseconds */
+  uint32_t timeout; /* Microseconds, at most period */
+  int delimiter; /* Last byte of a response, -1 for none */
+  uint32_t length; /* Length of a response, 0 for any */
+};
+
+/* Received serial data. Updated by the host, reported by stats. */
+struct ScratchRecvStats
+{
+  unsigned long reads; /* Reads from serial ports that returned data */
+  /* serialRecv, serialPoll and deviceState messages, binary frames */
+  unsigned long messages;
+  unsigned long long bytes; /* Serial data in them */
+  unsigned long delayed; /* Messages held back by coalescing */
+  unsigned long long delay_total; /* Microseconds, for all of them */
+  unsigned long delay_max; /* Microseconds */
+  unsigned long frames_dropped; /* Too long or malformed */
+  unsigned long frames_suppressed; /* Unchanged, with dedup */
+  unsigned long long bytes_suppressed;
+  unsigned long poll_queries;
+  unsigned long poll_responses;
+  unsigned long poll_timeouts; /* Incomplete responses */
+  unsigned long poll_late_max; /* Microseconds a query was sent late */
+};
+
+/* Credit based flow control. Off until the client sends
+   serial_credit. Credits are what has been granted minus what has
+   been sent as serialRecv data, for messages and bytes separately.
+   Poll responses and device state are not limited. A limit that has
+   never been granted is not enforced. */
+struct ScratchCredit
+{
+  /* The host holds back input without credits. Set by
+     scratch_protocol_set_credit_limits, otherwise grants are
+     ignored. */
+  int supported;
+  int messages_on;
+  int bytes_on;
+  unsigned long long messages_granted; /* In total */
+  unsigned long long bytes_granted;
+  /* serialRecv messages and binary frames sent, with their data */
+  unsigned long messages_spent;
+  unsigned long long bytes_spent;
+  /* Most credits a client may hold, from the configuration */
+  unsigned long max_messages;
+  unsigned long max_bytes;
+  unsigned long stalls; /* Times input was held back for credits */
+};
+
 struct ScratchProtocol
 {
   struct NativeMessage *nm;
   const struct ScratchSerialCallbacks *callbacks;
   void *serial_context;
+  /* Holds decoded data until it is written to a serial port */
+  uint8_t *write_buffer;
+  unsigned int write_capacity;
+  int binary; /* Binary framing negotiated */
+  /* Index of the request being handled */
+  struct JSONIndex index;
+  int command; /* Entry of the command array in index */
+  char token[SCRATCH_TOKEN_MAX]; /* Token of the request being handled */
+  int deferred; /* The reply is sent later */
+  struct JSONEmitter emit; /* Writes replies */
+  struct ScratchRecvStats recv_stats;
+  struct ScratchCredit credit;
+  /* Request being received in pieces. Allocated on first use. */
+  struct ScratchStream *stream;
+};
+
+/* Identifies the request a deferred reply belongs to */
+struct ScratchDeferredReply
+{
+  char token[SCRATCH_TOKEN_MAX];
 };
 
 struct ScratchSerialCallbacks
 {
   const char ** (*serial_get_ports)(void *context);
+  /* May call scratch_protocol_defer_reply and finish opening the port
+     later. The return value is ignored then. */
   int (*serial_open)(const char *port, struct SerialOpts *opts,
 		     void *context);
   int (*serial_close)(const char *port, void *context);
-  int (*serial_write)(const char *port, const uint8_t *data, unsigned int len, 
+  /* Returns a handle for an open port or NULL if it isn't open. The
+     handle is valid until the port is closed. */
+  void *(*serial_find)(const char *port, void *context);
+  /* Preferred number of bytes written to the port at a time */
+  unsigned int (*serial_write_size)(void *port, void *context);
+  /* Write all of data to a port returned by serial_find */
+  int (*serial_write)(void *port, const uint8_t *data, unsigned int len,
 		      void *context);
+  /* Start or stop polling a port returned by serial_find. Starting
+     replaces a running poll. NULL if the host doesn't poll. */
+  int (*serial_poll_start)(void *port, const struct ScratchPoll *poll,
+			   void *context);
+  int (*serial_poll_stop)(void *port, void *context);
 };
 
 void
@@ -29,8 +145,70 @@ scratch_protocol_init(struct ScratchProtocol *sp, struct NativeMessage *nm,
 void
 scratch_protocol_destroy(struct ScratchProtocol *sp);
 
+/* Called by a serial callback to reply to the current request later
+   instead of when the callback returns. Replies may be sent in a
+   different order than the requests arrived. */
+void
+scratch_protocol_defer_reply(struct ScratchProtocol *sp,
+			     struct ScratchDeferredReply *reply);
+
+/* Send a deferred reply */
+void
+scratch_protocol_complete(struct ScratchProtocol *sp,
+			  const struct ScratchDeferredReply *reply, int result);
+
+/* Send the changes of the device state kept by codec as
+   ["deviceState",<path>,<changes>]. Returns 0 on failure. */
+int
+scratch_protocol_send_state(struct ScratchProtocol *sp, const char *path,
+			    struct DeviceCodec *codec);
+
+/* Send a response to a poll as
+   ["serialPoll",<path>,<base64 data>,<sent>,<received>]. The times
+   are in milliseconds from an arbitrary start. */
+void
+scratch_protocol_send_poll_response(struct ScratchProtocol *sp,
+				    const char *path,
+				    const uint8_t *data, unsigned int len,
+				    uint64_t sent_us, uint64_t received_us);
+
+/* Largest number of credits a client may hold. 0 for no limit. Called
+   by hosts that enforce credits. */
+void
+scratch_protocol_set_credit_limits(struct ScratchProtocol *sp,
+				   unsigned long max_messages,
+				   unsigned long max_bytes);
+
+/* Count a serialRecv message or binary frame with len bytes of serial
+   data, in the stats and against the credits */
+void
+scratch_protocol_count_recv(struct ScratchProtocol *sp, unsigned int len);
+
+/* True if serialRecv data may be sent, i.e. credit based flow control
+   is off or there are credits left */
+int
+scratch_protocol_credit_available(const struct ScratchProtocol *sp);
+
+/* Write the header of a SCRATCH_BINARY_RECV frame to out. Returns the
+   number of bytes written or 0 if the path is too long. */
+unsigned int
+scratch_protocol_binary_recv_header(uint8_t *out, const char *path);
+
 void
 scratch_protocol_message_handler(struct ScratchProtocol *sp, 
 				   const uint8_t *msg, unsigned int len);
 
+/* Called with the start of a large message before the rest has been
+   received. Returns 1 for a serial_send_raw request, JSON or binary,
+   which is then written to the port as scratch_protocol_stream_data is
+   called with the whole message. Returns 0 if the message should be
+   received whole and passed to scratch_protocol_message_handler. */
+int
+scratch_protocol_stream_begin(struct ScratchProtocol *sp,
+			      const uint8_t *start, unsigned int start_len);
+
+void
+scratch_protocol_stream_data(struct ScratchProtocol *sp,
+			     const uint8_t *data, unsigned int len, int last);
+
 #endif /* __SCRATCH_PROTOCOL_H__P954VNN5E4__ */
@@ -3,14 +3,55 @@
 
 #include <stdint.h>
 
+/* Microseconds received data is held back when only coalesceBytes is
+   given */
+#define SERIAL_COALESCE_DELAY_DEFAULT 20000
+
+/* How received data is split into serialRecv messages */
+enum SerialFraming
+{
+  SERIAL_FRAMING_NONE, /* As read */
+  SERIAL_FRAMING_LINE, /* Ended by frameDelimiter */
+  SERIAL_FRAMING_SLIP, /* RFC 1055 */
+  SERIAL_FRAMING_COBS, /* Consistent Overhead Byte Stuffing, 0 ended */
+  SERIAL_FRAMING_FIXED, /* frameLength bytes each */
+  SERIAL_FRAMING_LENGTH /* Big endian length prefix of lengthBytes */
+};
+
+struct DeviceCodecClass;
+
 struct SerialOpts
 {
-  unsigned int bitRate;
-  unsigned int bufferSize;
+  uint32_t bitRate;
+  uint32_t bufferSize;
   uint8_t ctsFlowControl;
   uint8_t dataBits;
   uint8_t parityBit;
   uint8_t stopBits;
+  /* Received data is held back until this many microseconds have
+     passed since the first byte, or coalesceBytes have been received.
+     A delay of 0 with coalesceBytes set means
+     SERIAL_COALESCE_DELAY_DEFAULT. With both 0 data is sent as soon as
+     it is read. */
+  uint32_t coalesceDelay;
+  uint32_t coalesceBytes;
+  /* One of SERIAL_FRAMING_*. Coalescing is not done when framing. */
+  uint8_t framing;
+  uint8_t frameDelimiter;
+  uint8_t lengthBytes;
+  uint32_t frameLength;
+  /* Longer frames are dropped. 0 for bufferSize. */
+  uint32_t maxFrame;
+  /* Decodes received data in the host. NULL to send it as is.
+     Overrides framing. */
+  const struct DeviceCodecClass *codec;
+  /* Minimum microseconds between state updates. 0 to send them as
+     soon as the state changes. */
+  uint32_t codecInterval;
+  /* Drop frames equal to the last one sent, unless heartbeat
+     microseconds have passed since then. Needs framing. */
+  uint8_t dedup;
+  uint32_t heartbeat;
 };
 
 #endif /* __SERIAL_H__MBUJQ8UMMF__ */
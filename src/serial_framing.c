@@ -0,0 +1,270 @@
+#include "serial_framing.h"
+#include <stdlib.h>
+#include <string.h>
+#include <debug.h>
+
+#define SLIP_END 0xc0
+#define SLIP_ESC 0xdb
+#define SLIP_ESC_END 0xdc
+#define SLIP_ESC_ESC 0xdd
+
+int
+serial_framer_init(struct SerialFramer *f, const struct SerialOpts *opts)
+{
+  memset(f, 0, sizeof(*f));
+  f->mode = opts->framing;
+  f->delimiter = opts->frameDelimiter;
+  f->length_bytes = opts->lengthBytes;
+  f->frame_length = opts->frameLength;
+  f->max_frame = opts->maxFrame;
+  if (f->max_frame == 0) {
+    f->max_frame = opts->bufferSize > 0 ? opts->bufferSize : 4096;
+  }
+  if (f->max_frame > SERIAL_FRAME_MAX) f->max_frame = SERIAL_FRAME_MAX;
+  switch(f->mode) {
+  case SERIAL_FRAMING_NONE:
+    return 1;
+  case SERIAL_FRAMING_FIXED:
+    if (f->frame_length == 0 || f->frame_length > SERIAL_FRAME_MAX) {
+      PRINTERR("Fixed framing needs a frameLength of 1 to %u\n",
+	       SERIAL_FRAME_MAX);
+      return 0;
+    }
+    f->max_frame = f->frame_length;
+    f->capacity = f->frame_length;
+    break;
+  case SERIAL_FRAMING_LENGTH:
+    if (f->length_bytes != 1 && f->length_bytes != 2
+	&& f->length_bytes != 4) {
+      PRINTERR("lengthBytes must be 1, 2 or 4\n");
+      return 0;
+    }
+    f->capacity = f->max_frame;
+    break;
+  case SERIAL_FRAMING_COBS:
+    /* One code byte per 254 data bytes and one at the start */
+    f->capacity = f->max_frame + f->max_frame / 254 + 1;
+    break;
+  default:
+    f->capacity = f->max_frame;
+    break;
+  }
+  f->frame = malloc(f->capacity);
+  if (!f->frame) {
+    PRINTERR("No memory for frame buffer\n");
+    return 0;
+  }
+  return 1;
+}
+
+void
+serial_framer_destroy(struct SerialFramer *f)
+{
+  free(f->frame);
+  f->frame = NULL;
+}
+
+/* Add to the incomplete frame, or mark it for discarding if it
+   doesn't fit */
+static void
+append(struct SerialFramer *f, const uint8_t *data, unsigned int len)
+{
+  if (f->discard) return;
+  if (len > f->capacity - f->len) {
+    f->discard = 1;
+    return;
+  }
+  memcpy(f->frame + f->len, data, len);
+  f->len += len;
+}
+
+/* Decode a COBS frame in place. Returns the decoded length or -1 if
+   it is malformed. */
+static int
+cobs_decode(uint8_t *buf, unsigned int len)
+{
+  unsigned int in = 0;
+  unsigned int out = 0;
+  while(in < len) {
+    unsigned int code = buf[in++];
+    if (code == 0 || code - 1 > len - in) return -1;
+    memmove(buf + out, buf + in, code - 1);
+    out += code - 1;
+    in += code - 1;
+    if (code < 0xff && in < len) buf[out++] = 0;
+  }
+  return out;
+}
+
+/* A delimiter ends the current frame */
+static void
+end_frame(struct SerialFramer *f, serial_frame_cb cb, void *cb_data)
+{
+  int len = f->len;
+  if (f->discard) {
+    f->dropped++;
+  } else if (f->mode == SERIAL_FRAMING_COBS) {
+    if (len > 0) {
+      len = cobs_decode(f->frame, len);
+      if (len < 0 || len > f->max_frame) {
+	f->dropped++;
+      } else {
+	cb(f->frame, len, cb_data);
+      }
+    }
+  } else if (len > 0) {
+    cb(f->frame, len, cb_data);
+  }
+  f->len = 0;
+  f->discard = 0;
+}
+
+/* Frames ended by a delimiter byte. Runs up to the delimiter are
+   found with memchr, and complete frames are passed on without
+   copying when possible. */
+static void
+input_delimited(struct SerialFramer *f, uint8_t delimiter,
+		const uint8_t *data, unsigned int len,
+		serial_frame_cb cb, void *cb_data)
+{
+  while(len > 0) {
+    const uint8_t *end = memchr(data, delimiter, len);
+    unsigned int run = end ? end - data : len;
+    if (!end) {
+      append(f, data, run);
+      return;
+    }
+    if (f->len == 0 && !f->discard && f->mode == SERIAL_FRAMING_LINE) {
+      if (run <= f->max_frame) {
+	if (run > 0) cb(data, run, cb_data);
+      } else {
+	f->dropped++;
+      }
+    } else {
+      append(f, data, run);
+      end_frame(f, cb, cb_data);
+    }
+    data += run + 1;
+    len -= run + 1;
+  }
+}
+
+static void
+input_slip(struct SerialFramer *f, const uint8_t *data, unsigned int len,
+	   serial_frame_cb cb, void *cb_data)
+{
+  while(len > 0) {
+    unsigned int run = 0;
+    uint8_t c;
+    if (f->escape) {
+      f->escape = 0;
+      c = *data++;
+      len--;
+      if (c == SLIP_ESC_END) {
+	c = SLIP_END;
+      } else if (c == SLIP_ESC_ESC) {
+	c = SLIP_ESC;
+      } else if (c == SLIP_END) {
+	f->discard = 1;
+	end_frame(f, cb, cb_data);
+	continue;
+      } else {
+	f->discard = 1;
+      }
+      append(f, &c, 1);
+      continue;
+    }
+    while(run < len && data[run] != SLIP_END && data[run] != SLIP_ESC) run++;
+    append(f, data, run);
+    if (run == len) return;
+    if (data[run] == SLIP_END) {
+      end_frame(f, cb, cb_data);
+    } else {
+      f->escape = 1;
+    }
+    data += run + 1;
+    len -= run + 1;
+  }
+}
+
+/* Frames of f->need bytes. Whole frames in data are passed on
+   without copying. Returns the number of bytes consumed. */
+static unsigned int
+input_sized(struct SerialFramer *f, const uint8_t *data, unsigned int len,
+	    serial_frame_cb cb, void *cb_data)
+{
+  unsigned int n;
+  if (f->len == 0 && len >= f->need) {
+    cb(data, f->need, cb_data);
+    return f->need;
+  }
+  n = f->need - f->len;
+  if (n > len) n = len;
+  append(f, data, n);
+  if (f->len == f->need) {
+    cb(f->frame, f->len, cb_data);
+    f->len = 0;
+  }
+  return n;
+}
+
+static void
+input_length(struct SerialFramer *f, const uint8_t *data, unsigned int len,
+	     serial_frame_cb cb, void *cb_data)
+{
+  while(len > 0) {
+    unsigned int n;
+    if (f->skip > 0) {
+      n = f->skip < len ? f->skip : len;
+      f->skip -= n;
+    } else if (f->header_len < f->length_bytes) {
+      /* Big endian length prefix */
+      f->need = (f->header_len == 0 ? 0 : f->need << 8) | *data;
+      f->header_len++;
+      n = 1;
+      if (f->header_len == f->length_bytes && f->need > f->max_frame) {
+	f->dropped++;
+	f->skip = f->need;
+	f->header_len = 0;
+      } else if (f->header_len == f->length_bytes && f->need == 0) {
+	f->header_len = 0;
+      }
+    } else {
+      n = input_sized(f, data, len, cb, cb_data);
+      if (f->len == 0) f->header_len = 0;
+    }
+    data += n;
+    len -= n;
+  }
+}
+
+void
+serial_framer_input(struct SerialFramer *f, const uint8_t *data,
+		    unsigned int len, serial_frame_cb cb, void *cb_data)
+{
+  switch(f->mode) {
+  case SERIAL_FRAMING_NONE:
+    cb(data, len, cb_data);
+    break;
+  case SERIAL_FRAMING_LINE:
+    input_delimited(f, f->delimiter, data, len, cb, cb_data);
+    break;
+  case SERIAL_FRAMING_COBS:
+    input_delimited(f, 0, data, len, cb, cb_data);
+    break;
+  case SERIAL_FRAMING_SLIP:
+    input_slip(f, data, len, cb, cb_data);
+    break;
+  case SERIAL_FRAMING_FIXED:
+    f->need = f->frame_length;
+    while(len > 0) {
+      unsigned int n = input_sized(f, data, len, cb, cb_data);
+      data += n;
+      len -= n;
+    }
+    break;
+  case SERIAL_FRAMING_LENGTH:
+    input_length(f, data, len, cb, cb_data);
+    break;
+  }
+}
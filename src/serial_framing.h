@@ -0,0 +1,46 @@
+#ifndef __SERIAL_FRAMING_H__K4ZP8DNW2R__
+#define __SERIAL_FRAMING_H__K4ZP8DNW2R__
+
+#include <stdint.h>
+#include <serial.h>
+
+/* Largest frame accepted by any mode */
+#define SERIAL_FRAME_MAX (64*1024)
+
+/* Splits the data received from a port into frames as selected by
+   the framing options. Frames are reassembled across reads. */
+struct SerialFramer
+{
+  int mode; /* One of SERIAL_FRAMING_* */
+  uint8_t delimiter;
+  unsigned int length_bytes;
+  unsigned int frame_length;
+  unsigned int max_frame; /* No longer frames are passed on */
+  uint8_t *frame; /* Incomplete frame, still encoded for COBS */
+  unsigned int len;
+  unsigned int capacity;
+  unsigned int header_len; /* Length prefix bytes received */
+  uint32_t need; /* Frame length, from the length prefix */
+  uint32_t skip; /* Bytes left of an oversized length prefixed frame */
+  int escape; /* SLIP escape byte received */
+  int discard; /* Frame too long or malformed, drop it */
+  unsigned long dropped; /* Frames dropped since this was last cleared */
+};
+
+typedef void (*serial_frame_cb)(const uint8_t *frame, unsigned int len,
+				void *cb_data);
+
+/* Returns 0 if the options are inconsistent or there is no memory */
+int
+serial_framer_init(struct SerialFramer *f, const struct SerialOpts *opts);
+
+void
+serial_framer_destroy(struct SerialFramer *f);
+
+/* Call cb for each frame completed by data. The delimiters, escapes
+   and length prefixes are removed. Empty frames are skipped. */
+void
+serial_framer_input(struct SerialFramer *f, const uint8_t *data,
+		    unsigned int len, serial_frame_cb cb, void *cb_data);
+
+#endif /* __SERIAL_FRAMING_H__K4ZP8DNW2R__ */
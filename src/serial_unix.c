@@ -46,6 +46,7 @@ serial_open(const char *path, struct SerialOpts *opts)
   }
   if (tcgetattr(fd, &tio)) {
     PRINTERR("Failed to get serial settings: %s\n",strerror(errno));
+    close(fd);
     return -1;
   }
   tio.c_iflag |= IGNBRK | IGNPAR | INPCK;
@@ -64,6 +65,7 @@ serial_open(const char *path, struct SerialOpts *opts)
     break;
   default:
     PRINTERR("Illegal flowcontrol value\n");
+    close(fd);
     return -1;
   }
 
@@ -77,6 +79,7 @@ serial_open(const char *path, struct SerialOpts *opts)
     tio.c_cflag |= PARENB;
     break;
     PRINTERR("Illegal parity value\n");
+    close(fd);
     return -1;
   }
 
@@ -95,6 +98,7 @@ serial_open(const char *path, struct SerialOpts *opts)
     break;
   default:
     PRINTERR("Illegal number of data bits\n");
+    close(fd);
     return -1;
   }
   
@@ -107,12 +111,14 @@ serial_open(const char *path, struct SerialOpts *opts)
     break;
   default:
     PRINTERR("Illegal stop bit value\n");
+    close(fd);
     return -1;
   }
 
   for (s = 0; speed_map[s].bit_rate < opts->bitRate; s++);
   if (speed_map[s].bit_rate != opts->bitRate) {
     PRINTERR("Illegal bit rate\n");
+    close(fd);
     return -1;
   }
   cfsetispeed(&tio, speed_map[s].speed);
@@ -122,6 +128,7 @@ serial_open(const char *path, struct SerialOpts *opts)
   
   if (tcsetattr(fd, TCSAFLUSH, &tio)) {
     PRINTERR("Failed to set serial settings: %s\n",strerror(errno));
+    close(fd);
     return -1;
   }
   return fd;